@@ -87,11 +87,81 @@ namespace kiv_hal {
 										//OUT: Carry pokud je chyba
 										//		ax je NDisk_Status
 
-		Drive_Parameters = 0x48			//ziskej informaci o disku
+		Drive_Parameters = 0x48,		//ziskej informaci o disku
 										//IN:  dl cislo disku (0=A:, 1=druha mechanika, 0x80 prvni disk, 0x81 druhy disk, 0eh cd/dvd, etc.)
 										//		rdi je ukazatel na TDrive_Parameters
 										//OUT: carry pokud je chyba
 										//		ax je NDisk_Status
+
+		Read_Sectors_Vectored = 0x50,	//precti vice nesouvislych useku sektoru jednim prerusenim
+										//IN: dl je cislo disku
+										//	  rdi je adresa pole TDisk_Address_Packet, kazdy prvek je jeden usek
+										//	  rcx je pocet prvku pole
+										//OUT: Carry pokud je chyba; lezi-li nektery usek mimo disk, neprecte se nic
+										//		ax je NDisk_Status
+
+		Write_Sectors_Vectored = 0x51,	//zapis vice nesouvislych useku sektoru jednim prerusenim
+										//IN: dl je cislo disku
+										//	  rdi je adresa pole TDisk_Address_Packet, kazdy prvek je jeden usek
+										//	  rcx je pocet prvku pole
+										//OUT: Carry pokud je chyba
+										//		ax je NDisk_Status
+
+		Submit_Requests = 0x52,			//zarad pozadavky do asynchronni fronty disku, volani se vraci hned
+										//IN: dl je cislo disku
+										//	  rdi je adresa pole TDisk_Request
+										//	  rcx je pocet prvku pole
+										//	  pozadavky i jejich buffery musi zustat platne, dokud nejsou vyzvednuty pres Reap_Completions
+										//	  poradi vuci synchronnim sluzbam neni zaruceno
+										//OUT: Carry pokud je chyba, pak neni zarazen zadny pozadavek
+										//		ax je NDisk_Status
+
+		Reap_Completions = 0x53,		//vyzvedni dokoncene asynchronni pozadavky
+										//IN: dl je cislo disku
+										//	  rdi je adresa pole ukazatelu na TDisk_Request, kam se zapisi dokoncene pozadavky
+										//	  rcx je velikost pole
+										//	  bl != 0 znamena cekat, dokud neni dokoncen alespon jeden pozadavek
+										//OUT: rax je pocet vyzvednutych pozadavku
+										//		carry pokud je chyba, ax je NDisk_Status
+
+		Drive_Statistics = 0x54,		//ziskej okamzity stav statistik disku, sbiraji se jen se zapnutym Statistics v boot.ini
+										//IN: dl je cislo disku
+										//	  rdi je ukazatel na TDisk_Statistics
+										//OUT: carry pokud je chyba
+										//		ax je NDisk_Status
+
+		Discard_Changes = 0x55,			//zahod vsechny zapisy prekryvneho disku, disk bude opet shodny se zakladnim obrazem
+										//zaroven zahodi vsechny snimky disku
+										//IN: dl je cislo disku
+										//OUT: carry pokud je chyba, disky bez prekryvu vraci Bad_Command
+										//		ax je NDisk_Status
+
+		Snapshot = 0x56,				//sprava pojmenovanych snimku disku
+										//IN: dl je cislo disku
+										//	  rdi je adresa TDisk_Snapshot_Packet
+										//OUT: carry pokud je chyba, neznamy snimek vraci Sector_Not_Found
+										//		ax je NDisk_Status
+										//navraceni snimku meni sektory pod pripojenym souborovym systemem, ten je treba znovu pripojit
+
+		Flush = 0x57,					//zapis vsechny sektory odlozene v zapisove cache disku a vyprazdni buffery hostitele
+										//IN: dl je cislo disku
+										//OUT: carry pokud je chyba
+										//		ax je NDisk_Status
+
+		Discard_Sectors = 0x58			//oznam disku, ze obsah sektoru uz neni potreba (TRIM), obraz je pak nemusi drzet
+										//zahozene sektory se ctou jako nuly, jen prekryvny disk (Overlay) jim ponecha obsah
+										//IN: dl je cislo disku
+										//	  rdi je adresa pole TDisk_Address_Packet, sectors se nepouziva
+										//	  rcx je pocet prvku pole
+										//OUT: Carry pokud je chyba
+										//		ax je NDisk_Status
+	};
+
+	enum class NDisk_Snapshot : uint8_t {
+		Take = 0,				//porid snimek, existujici snimek stejneho jmena nahradi
+		Rollback,				//vrat disk do stavu snimku, novejsi snimky zahodi, snimek sam zustava
+		Export_Delta,			//zapis sektory zmenene od snimku do souboru ve formatu Overlay_Delta
+		Drop					//zahod snimek
 	};
 	
 	struct TDisk_Address_Packet {
@@ -100,6 +170,45 @@ namespace kiv_hal {
 		uint64_t lba_index;		//adresa prvniho sektoru na disku
 	};
 
+	struct TDisk_Request {
+		TDisk_Address_Packet dap;
+		NDisk_IO operation;		//NDisk_IO::Read_Sectors nebo NDisk_IO::Write_Sectors
+		uint16_t status;		//po dokonceni je zde NDisk_Status
+		uint64_t tag;			//libovolna hodnota volajiciho, HAL ji nemeni
+	};
+
+	struct TDisk_Snapshot_Packet {
+		NDisk_Snapshot operation;
+		const char *name;			//jmeno snimku
+		const char *delta_path;		//soubor pro NDisk_Snapshot::Export_Delta, jinak se nepouziva
+	};
+
+	const size_t Disk_Latency_Buckets = 24;		//i-ty kos pocita prenosy s latenci <2^i, 2^(i+1)) mikrosekund, nulty i vse kratsi
+
+	struct TDisk_Operation_Statistics {
+		uint64_t operations;				//pocet souvislych prenosu
+		uint64_t sectors;					//pocet prenesenych sektoru
+		uint64_t sequential;				//prenosy, ktere zacinaly hned za predchozim prenosem
+		uint64_t total_latency_us;
+		uint64_t latency_histogram[Disk_Latency_Buckets];
+	};
+
+	struct TDisk_Cache_Statistics {
+		bool enabled;						//false, pokud disk nema zapnutou Write_Cache_KB
+		uint64_t hits, misses;				//v sektorech, pocita se cteni i zapis
+		uint64_t written_back;				//sektory zapsane z cache na disk
+		uint64_t write_back_runs;			//souvisle useky, po kterych se zapisovalo
+	};
+
+	struct TDisk_Statistics {
+		bool enabled;						//false, pokud disk statistiky nesbira
+		TDisk_Operation_Statistics reads, writes;
+		uint64_t resident_bytes;			//kolik pameti disk skutecne zabira, vyplnuje se i bez zapnutych statistik
+		TDisk_Cache_Statistics cache;		//vyplnuje se i bez zapnutych statistik
+		uint64_t discarded_sectors;			//vyplnuje se i bez zapnutych statistik
+		uint64_t virtual_clock_us;			//cas, ktery disk stravil prenosy podle casoveho modelu z boot.ini, vyplnuje se i bez zapnutych statistik
+	};
+
 	struct TDrive_Parameters {
 		uint32_t cylinders, heads, sectors_per_track;
 		uint64_t absolute_number_of_sectors;
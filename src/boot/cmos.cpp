@@ -1,5 +1,6 @@
 #include "cmos.h"
 
+#include <algorithm>
 #include <fstream>
 
 CCMOS cmos{};
@@ -52,7 +53,30 @@ TCMOS_Drive_Parameters CCMOS::Drive_Parameters(uint8_t drive_index) {
 		result.is_ram_disk = mIni.GetBoolValue(section_full_name.c_str(), iiRAM_Disk);
 		result.read_only = mIni.GetBoolValue(section_full_name.c_str(), iiRead_Only);
 		result.disk_image = mIni.GetValue(section_full_name.c_str(), iiDisk_Image, L"");
-		result.RAM_Disk_Size = mIni.GetLongValue(section_full_name.c_str(), iiRAM_Disk_Size, result.bytes_per_sector);			//alespon jeden sektor
+		result.is_memory_mapped = mIni.GetBoolValue(section_full_name.c_str(), iiMemory_Mapped);
+		result.collect_statistics = mIni.GetBoolValue(section_full_name.c_str(), iiStatistics);
+		result.is_overlay = mIni.GetBoolValue(section_full_name.c_str(), iiOverlay);
+		result.overlay_delta = mIni.GetValue(section_full_name.c_str(), iiOverlay_Delta, L"");
+
+		result.timing.access_us = mIni.GetLongValue(section_full_name.c_str(), iiAccess_Latency, 0);
+		result.timing.seek_min_us = mIni.GetLongValue(section_full_name.c_str(), iiSeek_Min, 0);
+		result.timing.seek_max_us = mIni.GetLongValue(section_full_name.c_str(), iiSeek_Max, result.timing.seek_min_us);
+		result.timing.rpm = mIni.GetLongValue(section_full_name.c_str(), iiRPM, 0);
+		result.timing.bandwidth_MBps = mIni.GetLongValue(section_full_name.c_str(), iiBandwidth, 0);
+		result.write_cache_size = static_cast<size_t>((std::max)(0L, mIni.GetLongValue(section_full_name.c_str(), iiWrite_Cache, 0))) * 1024;
+
+		result.is_compressed = mIni.GetBoolValue(section_full_name.c_str(), iiCompressed);
+		result.compressed_source = mIni.GetValue(section_full_name.c_str(), iiCompressed_Source, L"");
+		result.compressed_cache_blocks = (std::max)(1L, mIni.GetLongValue(section_full_name.c_str(), iiCompressed_Cache_Blocks, 16));
+
+		result.timing.queue_depth = (std::max)(1L, mIni.GetLongValue(section_full_name.c_str(), iiQueue_Depth, 1));
+		const long bytes_per_sector = mIni.GetLongValue(section_full_name.c_str(), iiBytes_Per_Sector, static_cast<long>(result.bytes_per_sector));
+		if ((bytes_per_sector == 512) || (bytes_per_sector == 4096)) result.bytes_per_sector = static_cast<size_t>(bytes_per_sector);
+
+		//GetLongValue je na Windows jen 32bitovy, RAM disk ale muze mit i nekolik GiB
+		const wchar_t *ram_disk_size = mIni.GetValue(section_full_name.c_str(), iiRAM_Disk_Size, nullptr);
+		result.RAM_Disk_Size = (ram_disk_size != nullptr) ? static_cast<size_t>(_wcstoui64(ram_disk_size, nullptr, 10)) : 0;
+		result.RAM_Disk_Size = (std::max)(result.RAM_Disk_Size, result.bytes_per_sector);			//alespon jeden sektor
 	}
 
 	return result;
@@ -5,12 +5,31 @@
 
 #include <filesystem>
 
+//casovy model disku, vychozi nuly znamenaji prenos tak rychly, jak zvladne hostitel
+struct TCMOS_Disk_Timing {
+	uint32_t access_us = 0;				//pevna rezie prikazu, prikazy z fronty do hloubky queue_depth ji plati jen jednou
+	uint32_t seek_min_us = 0;			//presun hlavy o jeden sektor
+	uint32_t seek_max_us = 0;			//presun hlavy pres cely disk, mezi tim roste s odmocninou vzdalenosti
+	uint32_t rpm = 0;					//otacky, nesekvencni pristup ceka v prumeru pul otacky; 0 pro SSD
+	uint32_t bandwidth_MBps = 0;		//propustnost v MB/s, 0 bez omezeni
+	uint32_t queue_depth = 1;			//kolik pozadavku z asynchronni fronty disk najednou prevezme a seradi podle lba
+};
+
 struct TCMOS_Drive_Parameters {
 	bool is_present = false;
 	bool is_ram_disk = true;												//bud vytvorime neformatovany RAM disk
 	bool read_only = true;
+	bool is_memory_mapped = false;											//obraz disku namapujeme do pameti misto cteni pres fstream
+	bool collect_statistics = false;										//pocitadla a histogramy latenci prenosu
 	std::experimental::filesystem::path disk_image = "";					//anebo pouzijeme soubor z disku
-	const static size_t bytes_per_sector = 512;
+	bool is_overlay = false;												//disk_image je jen pro cteni a zapisy jdou do rozdiloveho souboru
+	std::experimental::filesystem::path overlay_delta = "";				//rozdilovy soubor, prazdna cesta znamena rozdil jen v pameti
+	TCMOS_Disk_Timing timing;
+	size_t write_cache_size = 0;											//velikost zapisove cache v bajtech, 0 ji vypne
+	bool is_compressed = false;												//disk_image je kontejner s nezavisle komprimovanymi bloky
+	std::experimental::filesystem::path compressed_source = "";			//neexistuje-li kontejner, vytvori se z tohoto suroveho obrazu
+	size_t compressed_cache_blocks = 16;									//kolik rozbalenych bloku drzime v pameti
+	size_t bytes_per_sector = 512;											//512 nebo 4096, jine hodnoty boot.ini ignorujeme
 	size_t RAM_Disk_Size = 0;
 };
 
@@ -24,6 +43,21 @@ protected:
 	const wchar_t* iiRead_Only = L"Ready_Only";
 	const wchar_t* iiDisk_Image = L"Disk_Image";
 	const wchar_t* iiRAM_Disk_Size = L"RAM_Disk_Size";
+	const wchar_t* iiBytes_Per_Sector = L"Bytes_Per_Sector";
+	const wchar_t* iiMemory_Mapped = L"Memory_Mapped";
+	const wchar_t* iiStatistics = L"Statistics";
+	const wchar_t* iiOverlay = L"Overlay";
+	const wchar_t* iiOverlay_Delta = L"Overlay_Delta";
+	const wchar_t* iiAccess_Latency = L"Access_Latency_us";
+	const wchar_t* iiSeek_Min = L"Seek_Min_us";
+	const wchar_t* iiSeek_Max = L"Seek_Max_us";
+	const wchar_t* iiRPM = L"RPM";
+	const wchar_t* iiBandwidth = L"Bandwidth_MBps";
+	const wchar_t* iiQueue_Depth = L"Queue_Depth";
+	const wchar_t* iiWrite_Cache = L"Write_Cache_KB";
+	const wchar_t* iiCompressed = L"Compressed";
+	const wchar_t* iiCompressed_Source = L"Compressed_Source";
+	const wchar_t* iiCompressed_Cache_Blocks = L"Compressed_Cache_Blocks";
 public:
 	CCMOS() noexcept;
 
@@ -2,37 +2,130 @@
 
 #include "disk.h"
 
+#include <algorithm>
 #include <array>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <iomanip>
 
 std::array<std::unique_ptr<CDisk_Drive>, 256> disk_drives;
+std::array<std::unique_ptr<CDisk_Queue>, 256> disk_queues;		//az za disky, aby se fronty rusily drive nez jejich disky
+std::array<std::once_flag, 256> disk_drives_created;
+std::mutex disk_queues_lock;		//fronta muze vzniknout z jednoho vlakna, zatimco ji jine vlakno hleda
+
+#pragma comment(lib, "Cabinet.lib")		//Compression API pro komprimovane obrazy
 
 #undef max
 
+//disk vytvori nejvyse jednou, i kdyz o nej poprve zada vic vlaken soucasne
+//neni-li disk v CMOS, zustane prazdny a kazdy dalsi pozadavek skonci s Drive_Not_Ready
+void Create_Drive(const uint8_t drive_index) {
+	auto cmos_params = cmos.Drive_Parameters(drive_index);
+	if (cmos_params.is_present) {
+		if (cmos_params.is_ram_disk) disk_drives[drive_index].reset(new CRAM_Disk{ cmos_params });
+			else if (cmos_params.is_overlay) {
+				//zakladni obraz otevreme jen pro cteni a bez statistik, cache a casoveho modelu, ty ma az prekryvny disk
+				auto base_params = cmos_params;
+				base_params.read_only = true;
+				base_params.collect_statistics = false;
+				base_params.write_cache_size = 0;
+				base_params.timing = TCMOS_Disk_Timing{};
+
+				std::unique_ptr<CDisk_Drive> base;
+				if (base_params.is_compressed) base.reset(new CCompressed_Disk_Image{ base_params });
+					else if (base_params.is_memory_mapped) base.reset(new CMapped_Disk_Image{ base_params });
+						else base.reset(new CDisk_Image{ base_params });
+
+				disk_drives[drive_index].reset(new COverlay_Disk{ cmos_params, std::move(base) });
+			}
+			else if (cmos_params.is_compressed) disk_drives[drive_index].reset(new CCompressed_Disk_Image{ cmos_params });
+			else if (cmos_params.is_memory_mapped) disk_drives[drive_index].reset(new CMapped_Disk_Image{ cmos_params });
+				else disk_drives[drive_index].reset(new CDisk_Image{ cmos_params });
+	}
+}
+
+CDisk_Queue *Disk_Queue(const uint8_t drive_index, const bool create) {
+	std::lock_guard<std::mutex> lock(disk_queues_lock);
+	if (create && !disk_queues[drive_index]) disk_queues[drive_index].reset(new CDisk_Queue{ *disk_drives[drive_index] });
+	return disk_queues[drive_index].get();
+}
+
 void __stdcall Disk_Handler(kiv_hal::TRegisters &context) {
+	std::call_once(disk_drives_created[context.rdx.l], Create_Drive, context.rdx.l);
 	if (!disk_drives[context.rdx.l]) {
-		auto cmos_params = cmos.Drive_Parameters(context.rdx.l);
-		if (cmos_params.is_present) {
-			if (cmos_params.is_ram_disk) disk_drives[context.rdx.l].reset(new CRAM_Disk{ cmos_params });
-				else disk_drives[context.rdx.l].reset(new CDisk_Image{ cmos_params });
-		}
-		else {
-			context.flags.carry = 1;
-			context.rax.x = static_cast<uint16_t>(kiv_hal::NDisk_Status::Drive_Not_Ready);
-		}
+		context.flags.carry = 1;
+		context.rax.x = static_cast<uint16_t>(kiv_hal::NDisk_Status::Drive_Not_Ready);
+		return;
 	}
 
 	switch (static_cast<kiv_hal::NDisk_IO>(context.rax.h)) {		
 		case kiv_hal::NDisk_IO::Read_Sectors:		return disk_drives[context.rdx.l]->Read_Sectors(context);
 		case kiv_hal::NDisk_IO::Write_Sectors:		return disk_drives[context.rdx.l]->Write_Sectors(context);
 		case kiv_hal::NDisk_IO::Drive_Parameters:	return disk_drives[context.rdx.l]->Drive_Parameters(context);
+		case kiv_hal::NDisk_IO::Read_Sectors_Vectored:	return disk_drives[context.rdx.l]->Read_Sectors_Vectored(context);
+		case kiv_hal::NDisk_IO::Write_Sectors_Vectored:	return disk_drives[context.rdx.l]->Write_Sectors_Vectored(context);
+		case kiv_hal::NDisk_IO::Drive_Statistics:	return disk_drives[context.rdx.l]->Drive_Statistics(context);
+		case kiv_hal::NDisk_IO::Discard_Changes:	return disk_drives[context.rdx.l]->Discard_Changes(context);
+		case kiv_hal::NDisk_IO::Snapshot:			return disk_drives[context.rdx.l]->Snapshot(context);
+		case kiv_hal::NDisk_IO::Flush:				return disk_drives[context.rdx.l]->Flush_Cache(context);
+		case kiv_hal::NDisk_IO::Discard_Sectors:	return disk_drives[context.rdx.l]->Discard_Sectors(context);
+
+		case kiv_hal::NDisk_IO::Submit_Requests:
+			//pracovni vlakno spoustime az pri prvnim asynchronnim pozadavku
+			return Disk_Queue(context.rdx.l, true)->Submit_Requests(context);
+
+		case kiv_hal::NDisk_IO::Reap_Completions: {
+				CDisk_Queue *queue = Disk_Queue(context.rdx.l, false);
+				if (queue) return queue->Reap_Completions(context);
+				context.flags.carry = 0;
+				context.rax.r = 0;		//nic nebylo zarazeno, takze nic nemuze byt ani dokonceno
+				return;
+			}
 
 		default: context.flags.carry = 1;
 				 context.rax.x = static_cast<uint16_t>(kiv_hal::NDisk_Status::Bad_Command);
 	}
 }
 
-CDisk_Drive::CDisk_Drive(const TCMOS_Drive_Parameters &cmos_parameters) : mBytes_Per_Sector(cmos_parameters.bytes_per_sector), mDisk_Size(0) {
+void Shutdown_Disks() {
+	for (auto &queue : disk_queues)
+		queue.reset();		//dokonci zarazene pozadavky
 
+	for (size_t i = 0; i < disk_drives.size(); i++) {
+		if (disk_drives[i]) {
+			disk_drives[i]->Synchronize();
+			disk_drives[i]->Print_Statistics(static_cast<uint8_t>(i));
+			disk_drives[i].reset();
+		}
+	}
+}
+
+CDisk_Drive::CDisk_Drive(const TCMOS_Drive_Parameters &cmos_parameters) : mBytes_Per_Sector(cmos_parameters.bytes_per_sector), mDisk_Size(0), mTiming(cmos_parameters.timing) {
+	mStatistics.enabled = cmos_parameters.collect_statistics;
+	mTiming_Enabled = (mTiming.access_us > 0) || (mTiming.seek_max_us > 0) || (mTiming.rpm > 0) || (mTiming.bandwidth_MBps > 0);
+
+	mCache_Capacity = cmos_parameters.write_cache_size / mBytes_Per_Sector;
+	mCache_Statistics.enabled = mCache_Capacity > 0;
+	mCache_Data.resize(mCache_Capacity * mBytes_Per_Sector);
+	for (size_t slot = mCache_Capacity; slot > 0; slot--)
+		mCache_Free_Slots.push_back(slot - 1);
+}
+
+CDisk_Drive::~CDisk_Drive() {
+
+}
+
+void CDisk_Drive::Flush() {
+	//vychozi disk nic neodklada, takze neni co zapisovat
+}
+
+kiv_hal::NDisk_Status CDisk_Drive::Discard_Delta() {
+	return kiv_hal::NDisk_Status::Bad_Command;		//zapisy jdou rovnou do obrazu, neni co zahodit
+}
+
+uint64_t CDisk_Drive::Disk_Size() const {
+	return mDisk_Size;
 }
 
 void CDisk_Drive::Set_Status(kiv_hal::TRegisters &context, const kiv_hal::NDisk_Status status) {
@@ -75,10 +168,16 @@ void CDisk_Drive::Drive_Parameters(kiv_hal::TRegisters &context) {
 }
 
 
+bool CDisk_Drive::Check_Range(const kiv_hal::TDisk_Address_Packet &dap) const {
+	const uint64_t number_of_sectors = mDisk_Size / mBytes_Per_Sector;
+	return (dap.lba_index <= number_of_sectors) && (dap.count <= number_of_sectors - dap.lba_index);
+		//odecitanim se vyhneme preteceni pri scitani lba_index + count
+}
+
 bool CDisk_Drive::Check_DAP(kiv_hal::TRegisters &context) {
 	kiv_hal::TDisk_Address_Packet &dap = *reinterpret_cast<kiv_hal::TDisk_Address_Packet*>(context.rdi.r);
 
-	if (mBytes_Per_Sector*(dap.lba_index + dap.count) >= mDisk_Size) {
+	if (!Check_Range(dap)) {
 		//nemuzeme dovolit, vysledkem by byl pristup za velikost disku
 		Set_Status(context, kiv_hal::NDisk_Status::Sector_Not_Found);
 		return false;
@@ -87,61 +186,1242 @@ bool CDisk_Drive::Check_DAP(kiv_hal::TRegisters &context) {
 	return true;
 }
 
-CDisk_Image::CDisk_Image(const TCMOS_Drive_Parameters &cmos_parameters) : CDisk_Drive(cmos_parameters) {
-	auto open_mode = std::ios::binary | std::ios::in;
-	if (!cmos_parameters.read_only) open_mode |= std::ios::out;
-	mDisk_Image.open(cmos_parameters.disk_image, open_mode);	
-	mDisk_Image.seekg(0, std::ios::end);      //rovnou nastavime pozici na konce souboru, protoze pri zapisu ji budeme stejne prestavovat
-	mDisk_Size = mDisk_Image.tellg();
+kiv_hal::NDisk_Status CDisk_Drive::Transfer(const kiv_hal::NDisk_IO operation, const kiv_hal::TDisk_Address_Packet &dap) {
+	if (!Check_Range(dap)) return kiv_hal::NDisk_Status::Sector_Not_Found;
+
+	if ((operation == kiv_hal::NDisk_IO::Read_Sectors) && Shared_Reads()) {
+		std::shared_lock<std::shared_timed_mutex> lock(mIO_Lock);
+		return Measured_Range(operation, dap, true);
+	}
+
+	std::lock_guard<std::shared_timed_mutex> lock(mIO_Lock);
+	return Measured_Range(operation, dap, true);
+}
+
+bool CDisk_Drive::Concurrent_Reads() const {
+	return false;
+}
+
+bool CDisk_Drive::Shared_Reads() const {
+	//cache i casovy model meni stav i pri cteni, takze pak se cte vyhradne
+	return Concurrent_Reads() && (mCache_Capacity == 0) && !mTiming_Enabled;
+}
+
+void CDisk_Drive::Transfer_Batch(std::vector<kiv_hal::TDisk_Request*> &batch) {
+	//fronta do davky nedava prekryvajici se pozadavky, takze je smime preradit jako radic s frontou prikazu
+	std::stable_sort(batch.begin(), batch.end(), [](const kiv_hal::TDisk_Request *a, const kiv_hal::TDisk_Request *b) { return a->dap.lba_index < b->dap.lba_index; });
+
+	std::lock_guard<std::shared_timed_mutex> lock(mIO_Lock);
+	bool new_command = true;
+	for (auto request : batch) {
+		if (!Check_Range(request->dap)) {
+			request->status = static_cast<uint16_t>(kiv_hal::NDisk_Status::Sector_Not_Found);
+			continue;
+		}
+
+		request->status = static_cast<uint16_t>(Measured_Range(request->operation, request->dap, new_command));
+		new_command = false;
+	}
+}
+
+size_t CDisk_Drive::Queue_Depth() const {
+	return mTiming.queue_depth;
 }
 
+uint64_t CDisk_Drive::Modeled_Time_us(const kiv_hal::TDisk_Address_Packet &dap, const bool new_command) {
+	if (!mTiming_Enabled) return 0;		//bez modelu nesmime menit ani polohu hlavy, cteni muze bezet soubezne
+
+	double time_us = new_command ? mTiming.access_us : 0.0;
+
+	const uint64_t distance = dap.lba_index > mHead_Lba ? dap.lba_index - mHead_Lba : mHead_Lba - dap.lba_index;
+	if (distance > 0) {
+		//cas presunu roste priblizne s odmocninou prejete vzdalenosti
+		const double sectors = static_cast<double>(std::max<size_t>(mDisk_Size / mBytes_Per_Sector, 1));
+		time_us += mTiming.seek_min_us + (static_cast<double>(mTiming.seek_max_us) - mTiming.seek_min_us) * std::sqrt(static_cast<double>(distance) / sectors);
+		if (mTiming.rpm > 0) time_us += 30.0e6 / mTiming.rpm;		//v prumeru pul otacky
+	}
+
+	if (mTiming.bandwidth_MBps > 0) time_us += static_cast<double>(dap.count*mBytes_Per_Sector) / mTiming.bandwidth_MBps;
+
+	mHead_Lba = dap.lba_index + dap.count;
+	return static_cast<uint64_t>(time_us);
+}
+
+void CDisk_Drive::Inject_Delay(const uint64_t modeled_us, const std::chrono::steady_clock::time_point &start) {
+	mVirtual_Clock_us += modeled_us;
+
+	//cas, ktery skutecny prenos uz spotreboval, z modelovaneho zpozdeni odecteme
+	const auto elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	mDelay_Debt_us += static_cast<int64_t>(modeled_us) - elapsed_us;
+	if (mDelay_Debt_us < 1000) return;
+
+	const auto sleep_start = std::chrono::steady_clock::now();
+	std::this_thread::sleep_for(std::chrono::microseconds(mDelay_Debt_us));
+	mDelay_Debt_us -= std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - sleep_start).count();
+}
+
+kiv_hal::NDisk_Status CDisk_Drive::Measured_Range(const kiv_hal::NDisk_IO operation, const kiv_hal::TDisk_Address_Packet &dap, const bool new_command) {
+	if ((operation != kiv_hal::NDisk_IO::Read_Sectors) && (operation != kiv_hal::NDisk_IO::Write_Sectors)) return kiv_hal::NDisk_Status::Bad_Command;
+
+	const bool is_read = operation == kiv_hal::NDisk_IO::Read_Sectors;
+	if (!mStatistics.enabled) return mCache_Capacity > 0 ? Cached_Range(operation, dap, new_command) : Device_Range(operation, dap, new_command);
+
+	const auto start = std::chrono::steady_clock::now();
+	const kiv_hal::NDisk_Status status = mCache_Capacity > 0 ? Cached_Range(operation, dap, new_command) : Device_Range(operation, dap, new_command);
+
+	const uint64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+	std::lock_guard<std::mutex> statistics_lock(mStatistics_Lock);		//soubezna cteni sdili pocitadla
+	kiv_hal::TDisk_Operation_Statistics &stats = is_read ? mStatistics.reads : mStatistics.writes;
+	stats.operations++;
+	stats.sectors += dap.count;
+	if (dap.lba_index == mNext_Sequential_Lba) stats.sequential++;
+	stats.total_latency_us += latency;
+
+	//kos je dany nejvyssim nastavenym bitem latence
+	size_t bucket = 0;
+	for (uint64_t remaining = latency >> 1; (remaining > 0) && (bucket < kiv_hal::Disk_Latency_Buckets - 1); remaining >>= 1) bucket++;
+	stats.latency_histogram[bucket]++;
+
+	mNext_Sequential_Lba = dap.lba_index + dap.count;
+
+	return status;
+}
+
+kiv_hal::NDisk_Status CDisk_Drive::Device_Range(const kiv_hal::NDisk_IO operation, const kiv_hal::TDisk_Address_Packet &dap, const bool new_command) {
+	const uint64_t modeled_us = Modeled_Time_us(dap, new_command);
+
+	const auto start = std::chrono::steady_clock::now();
+	const kiv_hal::NDisk_Status status = operation == kiv_hal::NDisk_IO::Read_Sectors ? Read_Range(dap) : Tracked_Write_Range(dap);
+	if (modeled_us > 0) Inject_Delay(modeled_us, start);
+
+	return status;
+}
+
+kiv_hal::NDisk_Status CDisk_Drive::Cached_Range(const kiv_hal::NDisk_IO operation, const kiv_hal::TDisk_Address_Packet &dap, const bool new_command) {
+	char *sectors = static_cast<char*>(dap.sectors);
+	kiv_hal::NDisk_Status status = kiv_hal::NDisk_Status::No_Error;
+
+	if (operation == kiv_hal::NDisk_IO::Write_Sectors) {
+		//zapis jen odlozime, na disk pujde az pri Write_Back
+		for (uint64_t i = 0; i < dap.count; i++) {
+			const uint64_t lba = dap.lba_index + i;
+			auto cached = mCache.find(lba);
+
+			char *sector;
+			if (cached != mCache.end()) {
+				mCache_Statistics.hits++;
+				mCache_LRU.splice(mCache_LRU.begin(), mCache_LRU, cached->second.lru);
+				sector = &mCache_Data[cached->second.slot * mBytes_Per_Sector];
+			}
+			else {
+				mCache_Statistics.misses++;
+				sector = Cache_Sector(lba, status);
+				if (!sector) return status;
+			}
+
+			memcpy(sector, sectors + i*mBytes_Per_Sector, mBytes_Per_Sector);
+			mCache[lba].dirty = true;
+			mCache_Dirty.insert(lba);
+		}
+
+		return status;
+	}
+
+	bool first_command = new_command;
+	uint64_t i = 0;
+	while (i < dap.count) {
+		const auto cached = mCache.find(dap.lba_index + i);
+		if (cached != mCache.end()) {
+			mCache_Statistics.hits++;
+			mCache_LRU.splice(mCache_LRU.begin(), mCache_LRU, cached->second.lru);
+			memcpy(sectors + i*mBytes_Per_Sector, &mCache_Data[cached->second.slot * mBytes_Per_Sector], mBytes_Per_Sector);
+			i++;
+			continue;
+		}
+
+		//chybejici sektory za sebou precteme z disku jednim prenosem
+		uint64_t run = 1;
+		while ((i + run < dap.count) && (mCache.find(dap.lba_index + i + run) == mCache.end())) run++;
+		mCache_Statistics.misses += run;
+
+		kiv_hal::TDisk_Address_Packet miss_dap;
+		miss_dap.lba_index = dap.lba_index + i;
+		miss_dap.count = run;
+		miss_dap.sectors = sectors + i*mBytes_Per_Sector;
+		status = Device_Range(kiv_hal::NDisk_IO::Read_Sectors, miss_dap, first_command);
+		if (status != kiv_hal::NDisk_Status::No_Error) return status;
+		first_command = false;
+
+		//prectene sektory si nechame jako ciste, nepovede-li se pro ne udelat misto, jen je neulozime
+		for (uint64_t j = 0; j < run; j++) {
+			kiv_hal::NDisk_Status cache_status;
+			char *sector = Cache_Sector(miss_dap.lba_index + j, cache_status);
+			if (!sector) break;
+			memcpy(sector, sectors + (i + j)*mBytes_Per_Sector, mBytes_Per_Sector);
+		}
+
+		i += run;
+	}
+
+	return status;
+}
+
+char *CDisk_Drive::Cache_Sector(const uint64_t lba, kiv_hal::NDisk_Status &status) {
+	if (mCache_Free_Slots.empty()) {
+		//vyhodime nejdele nepouzity sektor; je-li spinavy, zapiseme rovnou vsechny spinave, at je zapis souvisly
+		const uint64_t victim = mCache_LRU.back();
+		if (mCache[victim].dirty) {
+			status = Write_Back();
+			if (status != kiv_hal::NDisk_Status::No_Error) return nullptr;
+		}
+
+		mCache_Free_Slots.push_back(mCache[victim].slot);
+		mCache.erase(victim);
+		mCache_LRU.pop_back();
+	}
+
+	const size_t slot = mCache_Free_Slots.back();
+	mCache_Free_Slots.pop_back();
+
+	mCache_LRU.push_front(lba);
+	mCache[lba] = TCached_Sector{ slot, false, mCache_LRU.begin() };
+	status = kiv_hal::NDisk_Status::No_Error;
+	return &mCache_Data[slot * mBytes_Per_Sector];
+}
+
+kiv_hal::NDisk_Status CDisk_Drive::Write_Back() {
+	std::vector<char> run_data;
+
+	auto dirty = mCache_Dirty.begin();
+	while (dirty != mCache_Dirty.end()) {
+		//souvisly usek spinavych sektoru posleme na disk jednim prenosem
+		const uint64_t first_lba = *dirty;
+		uint64_t count = 0;
+		run_data.clear();
+		while ((dirty != mCache_Dirty.end()) && (*dirty == first_lba + count)) {
+			const auto sector = mCache_Data.begin() + mCache[*dirty].slot * mBytes_Per_Sector;
+			run_data.insert(run_data.end(), sector, sector + mBytes_Per_Sector);
+			count++;
+			dirty++;
+		}
+
+		kiv_hal::TDisk_Address_Packet dap;
+		dap.lba_index = first_lba;
+		dap.count = count;
+		dap.sectors = run_data.data();
+		const auto status = Device_Range(kiv_hal::NDisk_IO::Write_Sectors, dap, true);
+		if (status != kiv_hal::NDisk_Status::No_Error) {
+			mCache_Dirty.erase(mCache_Dirty.begin(), mCache_Dirty.find(first_lba));		//drivejsi useky uz zapsane jsou
+			return status;
+		}
+
+		for (uint64_t lba = first_lba; lba < first_lba + count; lba++)
+			mCache[lba].dirty = false;
+		mCache_Statistics.written_back += count;
+		mCache_Statistics.write_back_runs++;
+	}
+
+	mCache_Dirty.clear();
+	return kiv_hal::NDisk_Status::No_Error;
+}
+
+void CDisk_Drive::Drop_Cached(const kiv_hal::TDisk_Address_Packet &dap) {
+	auto drop = [this](const uint64_t lba) {
+		const auto cached = mCache.find(lba);
+		if (cached == mCache.end()) return;
+
+		mCache_Free_Slots.push_back(cached->second.slot);
+		mCache_LRU.erase(cached->second.lru);
+		mCache_Dirty.erase(lba);
+		mCache.erase(cached);
+	};
 
-void CDisk_Image::Read_Sectors(kiv_hal::TRegisters &context) {
+	//projdeme kratsi z obou, usek muze byt mnohem delsi nez cela cache
+	if (dap.count <= mCache.size()) {
+		for (uint64_t lba = dap.lba_index; lba < dap.lba_index + dap.count; lba++) drop(lba);
+	}
+	else {
+		std::vector<uint64_t> in_range;
+		for (const auto &cached : mCache)
+			if ((cached.first >= dap.lba_index) && (cached.first < dap.lba_index + dap.count)) in_range.push_back(cached.first);
+		for (const uint64_t lba : in_range) drop(lba);
+	}
+}
+
+void CDisk_Drive::Invalidate_Cache() {
+	mCache.clear();
+	mCache_LRU.clear();
+	mCache_Dirty.clear();
+	mCache_Free_Slots.clear();
+	for (size_t slot = mCache_Capacity; slot > 0; slot--)
+		mCache_Free_Slots.push_back(slot - 1);
+}
+
+kiv_hal::NDisk_Status CDisk_Drive::Synchronize() {
+	std::lock_guard<std::shared_timed_mutex> lock(mIO_Lock);
+	const auto status = Write_Back();
+	Flush();
+	return status;
+}
+
+void CDisk_Drive::Flush_Cache(kiv_hal::TRegisters &context) {
+	Set_Status(context, Synchronize());
+}
+
+void CDisk_Drive::Drive_Statistics(kiv_hal::TRegisters &context) {
+	kiv_hal::TDisk_Statistics &statistics = *reinterpret_cast<kiv_hal::TDisk_Statistics*>(context.rdi.r);
+
+	std::lock_guard<std::shared_timed_mutex> lock(mIO_Lock);
+	statistics = mStatistics;
+	statistics.resident_bytes = Resident_Size() + mCache_Data.size();
+	statistics.cache = mCache_Statistics;
+	statistics.discarded_sectors = mDiscarded_Sectors;
+	statistics.virtual_clock_us = mVirtual_Clock_us;
+	Set_Status(context, kiv_hal::NDisk_Status::No_Error);
+}
+
+void CDisk_Drive::Discard_Changes(kiv_hal::TRegisters &context) {
+	std::lock_guard<std::shared_timed_mutex> lock(mIO_Lock);
+	const auto status = Discard_Delta();
+	if (status != kiv_hal::NDisk_Status::No_Error) return Set_Status(context, status);
+
+	Invalidate_Cache();		//odlozene zapisy patri k zahozenemu rozdilu
+	mSnapshots.clear();		//puvodni obsahy uz neodpovidaji obsahu disku
+	Set_Status(context, status);
+}
+
+kiv_hal::NDisk_Status CDisk_Drive::Tracked_Write_Range(const kiv_hal::TDisk_Address_Packet &dap) {
+	const auto status = Preserve_Originals(dap);
+	return status == kiv_hal::NDisk_Status::No_Error ? Write_Range(dap) : status;
+}
+
+kiv_hal::NDisk_Status CDisk_Drive::Preserve_Originals(const kiv_hal::TDisk_Address_Packet &dap) {
+	if (mSnapshots.empty()) return kiv_hal::NDisk_Status::No_Error;
+
+	bool needs_originals = false;
+	for (const auto &snapshot : mSnapshots)
+		for (uint64_t i = 0; (i < dap.count) && !needs_originals; i++)
+			needs_originals = !snapshot.changed[static_cast<size_t>(dap.lba_index + i)];
+
+	if (needs_originals) {
+		//puvodni obsah precteme jednou pro vsechny snimky
+		std::vector<char> originals(static_cast<size_t>(dap.count*mBytes_Per_Sector));
+		kiv_hal::TDisk_Address_Packet original_dap = dap;
+		original_dap.sectors = originals.data();
+		const auto status = Read_Range(original_dap);
+		if (status != kiv_hal::NDisk_Status::No_Error) return status;
+
+		for (auto &snapshot : mSnapshots)
+			for (uint64_t i = 0; i < dap.count; i++) {
+				const size_t lba = static_cast<size_t>(dap.lba_index + i);
+				if (snapshot.changed[lba]) continue;
+
+				snapshot.changed[lba] = true;
+				snapshot.lbas.push_back(lba);
+				const auto sector = originals.begin() + static_cast<size_t>(i*mBytes_Per_Sector);
+				snapshot.originals.insert(snapshot.originals.end(), sector, sector + mBytes_Per_Sector);
+			}
+	}
+
+	return kiv_hal::NDisk_Status::No_Error;
+}
+
+kiv_hal::NDisk_Status CDisk_Drive::Discard_Range(const kiv_hal::TDisk_Address_Packet &dap) {
+	const uint64_t zero_sectors = 128;
+	std::vector<char> zeros(static_cast<size_t>(zero_sectors*mBytes_Per_Sector), 0);
+
+	for (uint64_t i = 0; i < dap.count; i += zero_sectors) {
+		kiv_hal::TDisk_Address_Packet zero_dap;
+		zero_dap.lba_index = dap.lba_index + i;
+		zero_dap.count = (std::min)(zero_sectors, dap.count - i);
+		zero_dap.sectors = zeros.data();
+
+		const auto status = Write_Range(zero_dap);
+		if (status != kiv_hal::NDisk_Status::No_Error) return status;
+	}
+
+	return kiv_hal::NDisk_Status::No_Error;
+}
+
+void CDisk_Drive::Discard_Sectors(kiv_hal::TRegisters &context) {
+	const kiv_hal::TDisk_Address_Packet *segments = reinterpret_cast<kiv_hal::TDisk_Address_Packet*>(context.rdi.r);
+	const size_t count = static_cast<size_t>(context.rcx.r);
+
+	for (size_t i = 0; i < count; i++)
+		if (!Check_Range(segments[i])) {
+			Set_Status(context, kiv_hal::NDisk_Status::Sector_Not_Found);
+			return;
+		}
+
+	std::lock_guard<std::shared_timed_mutex> lock(mIO_Lock);
+	kiv_hal::NDisk_Status status = kiv_hal::NDisk_Status::No_Error;
+	for (size_t i = 0; (i < count) && (status == kiv_hal::NDisk_Status::No_Error); i++) {
+		Drop_Cached(segments[i]);		//odlozene zapisy zahozenych sektoru uz nikoho nezajimaji
+
+		//snimky musi i po zahozeni umet puvodni obsah vratit
+		status = Preserve_Originals(segments[i]);
+		if (status == kiv_hal::NDisk_Status::No_Error) status = Discard_Range(segments[i]);
+		if (status == kiv_hal::NDisk_Status::No_Error) mDiscarded_Sectors += segments[i].count;
+	}
+
+	Set_Status(context, status);
+}
+
+std::vector<CDisk_Drive::TSnapshot>::iterator CDisk_Drive::Find_Snapshot(const std::string &name) {
+	return std::find_if(mSnapshots.begin(), mSnapshots.end(), [&name](const TSnapshot &snapshot) { return snapshot.name == name; });
+}
+
+kiv_hal::NDisk_Status CDisk_Drive::Rollback_Snapshot(const std::vector<TSnapshot>::iterator snapshot) {
+	//novejsi snimky popisuji stav, ktery navracenim zanikne
+	mSnapshots.erase(snapshot + 1, mSnapshots.end());
+
+	//snimek vyjmeme, aby navraceni samo nezapisovalo do jeho bitmapy, starsi snimky si ale puvodni obsah schovat musi
+	TSnapshot restored = std::move(mSnapshots.back());
+	mSnapshots.pop_back();
+
+	kiv_hal::NDisk_Status status = kiv_hal::NDisk_Status::No_Error;
+	for (size_t i = 0; (i < restored.lbas.size()) && (status == kiv_hal::NDisk_Status::No_Error); i++) {
+		kiv_hal::TDisk_Address_Packet dap;
+		dap.lba_index = restored.lbas[i];
+		dap.count = 1;
+		dap.sectors = &restored.originals[i*mBytes_Per_Sector];
+		status = Tracked_Write_Range(dap);
+	}
+
+	//snimek zustava, takze se k nemu lze vracet opakovane
+	restored.lbas.clear();
+	restored.originals.clear();
+	restored.changed.assign(restored.changed.size(), false);
+	mSnapshots.push_back(std::move(restored));
+
+	return status;
+}
+
+kiv_hal::NDisk_Status CDisk_Drive::Export_Snapshot_Delta(const TSnapshot &snapshot, const char *delta_path) {
+	//zaznam je lba a za nim soucasny obsah sektoru, stejne jako v rozdilu prekryvneho disku
+	std::ofstream delta{ delta_path, std::ios::binary | std::ios::trunc };
+	if (!delta.is_open()) return kiv_hal::NDisk_Status::Fixed_Disk_Write_Fault_On_Selected_Drive;
+
+	std::vector<char> sector(mBytes_Per_Sector);
+	for (const uint64_t lba : snapshot.lbas) {
+		kiv_hal::TDisk_Address_Packet dap;
+		dap.lba_index = lba;
+		dap.count = 1;
+		dap.sectors = sector.data();
+		const auto status = Read_Range(dap);
+		if (status != kiv_hal::NDisk_Status::No_Error) return status;
+
+		delta.write(reinterpret_cast<const char*>(&lba), sizeof(lba));
+		delta.write(sector.data(), sector.size());
+	}
+
+	return delta.good() ? kiv_hal::NDisk_Status::No_Error : kiv_hal::NDisk_Status::Fixed_Disk_Write_Fault_On_Selected_Drive;
+}
+
+void CDisk_Drive::Snapshot(kiv_hal::TRegisters &context) {
+	const kiv_hal::TDisk_Snapshot_Packet &packet = *reinterpret_cast<kiv_hal::TDisk_Snapshot_Packet*>(context.rdi.r);
+	if (!packet.name) return Set_Status(context, kiv_hal::NDisk_Status::Bad_Command);
+	const std::string name{ packet.name };
+
+	std::lock_guard<std::shared_timed_mutex> lock(mIO_Lock);
+	auto snapshot = Find_Snapshot(name);
+
+	//snimky sleduji sektory na zarizeni, takze na nem nejprve musi byt i odlozene zapisy
+	const auto written_back = Write_Back();
+	if (written_back != kiv_hal::NDisk_Status::No_Error) return Set_Status(context, written_back);
+
+	switch (packet.operation) {
+		case kiv_hal::NDisk_Snapshot::Take: {
+				if (snapshot != mSnapshots.end()) mSnapshots.erase(snapshot);
+
+				TSnapshot taken;
+				taken.name = name;
+				taken.changed.resize(mDisk_Size / mBytes_Per_Sector, false);
+				mSnapshots.push_back(std::move(taken));
+				return Set_Status(context, kiv_hal::NDisk_Status::No_Error);
+			}
+
+		case kiv_hal::NDisk_Snapshot::Rollback:
+			if (snapshot == mSnapshots.end()) return Set_Status(context, kiv_hal::NDisk_Status::Sector_Not_Found);
+			Invalidate_Cache();		//ciste sektory v cache by po navraceni neodpovidaly disku
+			return Set_Status(context, Rollback_Snapshot(snapshot));
+
+		case kiv_hal::NDisk_Snapshot::Export_Delta:
+			if (snapshot == mSnapshots.end()) return Set_Status(context, kiv_hal::NDisk_Status::Sector_Not_Found);
+			if (!packet.delta_path) return Set_Status(context, kiv_hal::NDisk_Status::Bad_Command);
+			return Set_Status(context, Export_Snapshot_Delta(*snapshot, packet.delta_path));
+
+		case kiv_hal::NDisk_Snapshot::Drop:
+			if (snapshot == mSnapshots.end()) return Set_Status(context, kiv_hal::NDisk_Status::Sector_Not_Found);
+			mSnapshots.erase(snapshot);
+			return Set_Status(context, kiv_hal::NDisk_Status::No_Error);
+
+		default:
+			return Set_Status(context, kiv_hal::NDisk_Status::Bad_Command);
+	}
+}
+
+void CDisk_Drive::Print_Statistics(const uint8_t drive_index) {
+	if (!mStatistics.enabled) return;
+
+	std::wcout << L"Disk 0x" << std::hex << std::setw(2) << std::setfill(L'0') << static_cast<unsigned>(drive_index) << std::dec << std::setfill(L' ') << std::endl;
+
+	auto print = [](const wchar_t *name, const kiv_hal::TDisk_Operation_Statistics &stats) {
+		std::wcout << L"  " << name << L": " << stats.operations << L" prenosu, " << stats.sectors << L" sektoru, "
+			<< stats.sequential << L" sekvencne, " << stats.total_latency_us << L" us celkem" << std::endl;
+
+		for (size_t i = 0; i < kiv_hal::Disk_Latency_Buckets; i++)
+			if (stats.latency_histogram[i] > 0)
+				std::wcout << L"    <" << (1ull << (i + 1)) << L" us: " << stats.latency_histogram[i] << std::endl;
+	};
+
+	print(L"cteni", mStatistics.reads);
+	print(L"zapis", mStatistics.writes);
+	if (mCache_Statistics.enabled)
+		std::wcout << L"  cache: " << mCache_Statistics.hits << L" zasahu, " << mCache_Statistics.misses << L" minuti, "
+			<< mCache_Statistics.written_back << L" sektoru zapsano v " << mCache_Statistics.write_back_runs << L" usecich" << std::endl;
+	std::wcout << L"  zahozeno: " << mDiscarded_Sectors << L" sektoru" << std::endl;
+	std::wcout << L"  v pameti: " << Resident_Size() + mCache_Data.size() << L" B" << std::endl;
+	std::wcout << L"  modelovany cas: " << mVirtual_Clock_us << L" us" << std::endl;
+}
+
+uint64_t CDisk_Drive::Resident_Size() {
+	return 0;
+}
+
+void CDisk_Drive::Read_Sectors(kiv_hal::TRegisters &context) {
 	if (Check_DAP(context)) {
 		kiv_hal::TDisk_Address_Packet &dap = *reinterpret_cast<kiv_hal::TDisk_Address_Packet*>(context.rdi.r);
-		mDisk_Image.seekg(mBytes_Per_Sector*dap.lba_index, std::ios::beg);
-		const auto bytes_to_read = dap.count*mBytes_Per_Sector;
-		mDisk_Image.read(static_cast<char*>(dap.sectors), bytes_to_read);
-		if (mDisk_Image.gcount() == bytes_to_read) Set_Status(context, kiv_hal::NDisk_Status::No_Error);
-			else Set_Status(context, kiv_hal::NDisk_Status::Address_Mark_Not_Found_Or_Bad_Sector);
+		Set_Status(context, Transfer(kiv_hal::NDisk_IO::Read_Sectors, dap));
 	}
 }
 
-void CDisk_Image::Write_Sectors(kiv_hal::TRegisters &context) {
+void CDisk_Drive::Write_Sectors(kiv_hal::TRegisters &context) {
 	if (Check_DAP(context)) {
 		kiv_hal::TDisk_Address_Packet &dap = *reinterpret_cast<kiv_hal::TDisk_Address_Packet*>(context.rdi.r);
-		mDisk_Image.seekg(mBytes_Per_Sector*dap.lba_index, std::ios::beg);
-		const auto bytes_to_write = dap.count*mBytes_Per_Sector;
+		Set_Status(context, Transfer(kiv_hal::NDisk_IO::Write_Sectors, dap));
+	}
+}
+
+void CDisk_Drive::Read_Sectors_Vectored(kiv_hal::TRegisters &context) {
+	const kiv_hal::TDisk_Address_Packet *segments = reinterpret_cast<kiv_hal::TDisk_Address_Packet*>(context.rdi.r);
+	const size_t count = static_cast<size_t>(context.rcx.r);
+
+	//nejprve zkontrolujeme vsechny useky, abychom v pripade chyby nic nezacali prenaset
+	for (size_t i = 0; i < count; i++)
+		if (!Check_Range(segments[i])) {
+			Set_Status(context, kiv_hal::NDisk_Status::Sector_Not_Found);
+			return;
+		}
+
+	std::shared_lock<std::shared_timed_mutex> shared_lock(mIO_Lock, std::defer_lock);
+	std::unique_lock<std::shared_timed_mutex> exclusive_lock(mIO_Lock, std::defer_lock);
+	if (Shared_Reads()) shared_lock.lock();
+		else exclusive_lock.lock();
+
+	kiv_hal::NDisk_Status status = kiv_hal::NDisk_Status::No_Error;
+	for (size_t i = 0; (i < count) && (status == kiv_hal::NDisk_Status::No_Error); i++)
+		status = Measured_Range(kiv_hal::NDisk_IO::Read_Sectors, segments[i], i == 0);
+
+	Set_Status(context, status);
+}
+
+void CDisk_Drive::Write_Sectors_Vectored(kiv_hal::TRegisters &context) {
+	const kiv_hal::TDisk_Address_Packet *segments = reinterpret_cast<kiv_hal::TDisk_Address_Packet*>(context.rdi.r);
+	const size_t count = static_cast<size_t>(context.rcx.r);
+
+	for (size_t i = 0; i < count; i++)
+		if (!Check_Range(segments[i])) {
+			Set_Status(context, kiv_hal::NDisk_Status::Sector_Not_Found);
+			return;
+		}
+
+	std::lock_guard<std::shared_timed_mutex> lock(mIO_Lock);
+	kiv_hal::NDisk_Status status = kiv_hal::NDisk_Status::No_Error;
+	for (size_t i = 0; (i < count) && (status == kiv_hal::NDisk_Status::No_Error); i++)
+		status = Measured_Range(kiv_hal::NDisk_IO::Write_Sectors, segments[i], i == 0);
+
+	Set_Status(context, status);
+}
+
+CDisk_Image::CDisk_Image(const TCMOS_Drive_Parameters &cmos_parameters) : CDisk_Drive(cmos_parameters) {
+	//prekryvane I/O, kazdy prenos nese svou pozici v OVERLAPPED a soubor tak nema zadnou sdilenou pozici
+	const DWORD access = cmos_parameters.read_only ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE;
+	mImage_File = CreateFileW(cmos_parameters.disk_image.wstring().c_str(), access, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+	if (mImage_File == INVALID_HANDLE_VALUE) return;			//mDisk_Size zustane 0, takze kazdy pristup skonci na Check_DAP
+
+	LARGE_INTEGER file_size;
+	if (GetFileSizeEx(mImage_File, &file_size)) mDisk_Size = static_cast<size_t>(file_size.QuadPart);
+
+	//ridky soubor, aby zahozene sektory mohly byt dirami; neumi-li to souborovy system, zahazuje se zapisem nul
+	if (!cmos_parameters.read_only) Device_Control(FSCTL_SET_SPARSE, NULL, 0);
+}
+
+bool CDisk_Image::Device_Control(const DWORD code, void *input, const DWORD input_size) {
+	HANDLE completed = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if (!completed) return false;
+
+	OVERLAPPED overlapped{};
+	overlapped.hEvent = completed;
+
+	DWORD returned = 0;
+	BOOL done = DeviceIoControl(mImage_File, code, input, input_size, NULL, 0, &returned, &overlapped);
+	if (!done && (GetLastError() == ERROR_IO_PENDING)) done = GetOverlappedResult(mImage_File, &overlapped, &returned, TRUE);
+
+	CloseHandle(completed);
+	return done != FALSE;
+}
+
+kiv_hal::NDisk_Status CDisk_Image::Discard_Range(const kiv_hal::TDisk_Address_Packet &dap) {
+	FILE_ZERO_DATA_INFORMATION zero_data;
+	zero_data.FileOffset.QuadPart = static_cast<LONGLONG>(dap.lba_index*mBytes_Per_Sector);
+	zero_data.BeyondFinalZero.QuadPart = static_cast<LONGLONG>((dap.lba_index + dap.count)*mBytes_Per_Sector);
+
+	if (Device_Control(FSCTL_SET_ZERO_DATA, &zero_data, sizeof(zero_data))) return kiv_hal::NDisk_Status::No_Error;
+	return CDisk_Drive::Discard_Range(dap);
+}
+
+CDisk_Image::~CDisk_Image() {
+	if (mImage_File != INVALID_HANDLE_VALUE) CloseHandle(mImage_File);
+}
+
+bool CDisk_Image::Positional_IO(const bool write, char *buffer, uint64_t offset, uint64_t bytes) {
+	//kazdy prenos ma vlastni udalost, aby se soubezne prenosy na stejnem souboru nebudily navzajem
+	HANDLE completed = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if (!completed) return false;
+
+	bool result = true;
+	while (result && (bytes > 0)) {
+		const DWORD chunk = static_cast<DWORD>((std::min)(bytes, static_cast<uint64_t>(1) << 30));		//ReadFile/WriteFile berou jen DWORD
+
+		OVERLAPPED overlapped{};
+		overlapped.Offset = static_cast<DWORD>(offset);
+		overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+		overlapped.hEvent = completed;
 
-		const auto before = mDisk_Image.tellp();
-		mDisk_Image.write(static_cast<char*>(dap.sectors), bytes_to_write);
-		const auto number_of_bytes_written = mDisk_Image.tellp() - before;
+		DWORD transferred = 0;
+		BOOL done = write ? WriteFile(mImage_File, buffer, chunk, &transferred, &overlapped) : ReadFile(mImage_File, buffer, chunk, &transferred, &overlapped);
+		if (!done && (GetLastError() == ERROR_IO_PENDING)) done = GetOverlappedResult(mImage_File, &overlapped, &transferred, TRUE);
 
-		if (number_of_bytes_written == bytes_to_write) Set_Status(context, kiv_hal::NDisk_Status::No_Error);
-			else Set_Status(context, kiv_hal::NDisk_Status::Fixed_Disk_Write_Fault_On_Selected_Drive);
+		result = done && (transferred == chunk);
+		buffer += chunk;
+		offset += chunk;
+		bytes -= chunk;
+	}
+
+	CloseHandle(completed);
+	return result;
+}
+
+kiv_hal::NDisk_Status CDisk_Image::Read_Range(const kiv_hal::TDisk_Address_Packet &dap) {
+	return Positional_IO(false, static_cast<char*>(dap.sectors), dap.lba_index*mBytes_Per_Sector, dap.count*mBytes_Per_Sector) ? kiv_hal::NDisk_Status::No_Error : kiv_hal::NDisk_Status::Address_Mark_Not_Found_Or_Bad_Sector;
+}
+
+kiv_hal::NDisk_Status CDisk_Image::Write_Range(const kiv_hal::TDisk_Address_Packet &dap) {
+	return Positional_IO(true, static_cast<char*>(dap.sectors), dap.lba_index*mBytes_Per_Sector, dap.count*mBytes_Per_Sector) ? kiv_hal::NDisk_Status::No_Error : kiv_hal::NDisk_Status::Fixed_Disk_Write_Fault_On_Selected_Drive;
+}
+
+bool CDisk_Image::Concurrent_Reads() const {
+	return true;
+}
+
+void CDisk_Image::Flush() {
+	if (mImage_File != INVALID_HANDLE_VALUE) FlushFileBuffers(mImage_File);
+}
+
+CMapped_Disk_Image::CMapped_Disk_Image(const TCMOS_Drive_Parameters &cmos_parameters) : CDisk_Drive(cmos_parameters), mRead_Only(cmos_parameters.read_only) {
+	const DWORD access = mRead_Only ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE;
+	mImage_File = CreateFileW(cmos_parameters.disk_image.wstring().c_str(), access, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+	if (mImage_File == INVALID_HANDLE_VALUE) return;			//mDisk_Size zustane 0, takze kazdy pristup skonci na Check_DAP
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(mImage_File, &file_size) || (file_size.QuadPart == 0)) return;	//prazdny soubor namapovat nelze
+
+	mImage_Mapping = CreateFileMappingW(mImage_File, NULL, mRead_Only ? PAGE_READONLY : PAGE_READWRITE, 0, 0, NULL);
+	if (!mImage_Mapping) return;
+
+	mView = static_cast<char*>(MapViewOfFile(mImage_Mapping, mRead_Only ? FILE_MAP_READ : FILE_MAP_WRITE, 0, 0, 0));
+	if (mView) mDisk_Size = static_cast<size_t>(file_size.QuadPart);
+}
+
+CMapped_Disk_Image::~CMapped_Disk_Image() {
+	if (mView) UnmapViewOfFile(mView);
+	if (mImage_Mapping) CloseHandle(mImage_Mapping);
+	if (mImage_File != INVALID_HANDLE_VALUE) CloseHandle(mImage_File);
+}
+
+kiv_hal::NDisk_Status CMapped_Disk_Image::Read_Range(const kiv_hal::TDisk_Address_Packet &dap) {
+	memcpy(dap.sectors, mView + dap.lba_index*mBytes_Per_Sector, mBytes_Per_Sector*dap.count);
+	return kiv_hal::NDisk_Status::No_Error;
+}
+
+kiv_hal::NDisk_Status CMapped_Disk_Image::Write_Range(const kiv_hal::TDisk_Address_Packet &dap) {
+	if (mRead_Only) return kiv_hal::NDisk_Status::Fixed_Disk_Write_Fault_On_Selected_Drive;
+
+	memcpy(mView + dap.lba_index*mBytes_Per_Sector, dap.sectors, mBytes_Per_Sector*dap.count);
+	return kiv_hal::NDisk_Status::No_Error;
+}
+
+bool CMapped_Disk_Image::Concurrent_Reads() const {
+	return true;
+}
+
+void CMapped_Disk_Image::Flush() {
+	//zapsane stranky jsou zatim jenom v pameti, takze je musime explicitne vypsat do souboru
+	if (mView && !mRead_Only) {
+		FlushViewOfFile(mView, 0);
+		FlushFileBuffers(mImage_File);
 	}
 }
 
 CRAM_Disk::CRAM_Disk(const TCMOS_Drive_Parameters &cmos_parameters) : CDisk_Drive(cmos_parameters) {
 	mDisk_Size = cmos_parameters.RAM_Disk_Size;
-	mDisk_Image.resize(mDisk_Size);
+	mChunks.resize((mDisk_Size + Chunk_Size - 1) / Chunk_Size);	//zatim jen prazdne ukazatele, data se alokuji az pri zapisu
 }
 
 
-void CRAM_Disk::Read_Sectors(kiv_hal::TRegisters &context) {
-	if (Check_DAP(context)) {
-		kiv_hal::TDisk_Address_Packet &dap = *reinterpret_cast<kiv_hal::TDisk_Address_Packet*>(context.rdi.r);
+kiv_hal::NDisk_Status CRAM_Disk::Read_Range(const kiv_hal::TDisk_Address_Packet &dap) {
+	char *dst = static_cast<char*>(dap.sectors);
+	uint64_t offset = dap.lba_index*mBytes_Per_Sector;
+	size_t remaining = static_cast<size_t>(mBytes_Per_Sector*dap.count);
 
-		memcpy(dap.sectors, &mDisk_Image[dap.lba_index*mBytes_Per_Sector], mBytes_Per_Sector*dap.count);
-		Set_Status(context, kiv_hal::NDisk_Status::No_Error);
+	while (remaining > 0) {
+		const size_t chunk_offset = static_cast<size_t>(offset % Chunk_Size);
+		const size_t len = (std::min)(remaining, Chunk_Size - chunk_offset);
+		const auto &chunk = mChunks[static_cast<size_t>(offset / Chunk_Size)];
+
+		if (chunk) memcpy(dst, chunk.get() + chunk_offset, len);
+			else memset(dst, 0, len);
+
+		dst += len;
+		offset += len;
+		remaining -= len;
 	}
+
+	return kiv_hal::NDisk_Status::No_Error;
 }
 
-void CRAM_Disk::Write_Sectors(kiv_hal::TRegisters &context) {
-	if (Check_DAP(context)) {
-		kiv_hal::TDisk_Address_Packet &dap = *reinterpret_cast<kiv_hal::TDisk_Address_Packet*>(context.rdi.r);
+kiv_hal::NDisk_Status CRAM_Disk::Write_Range(const kiv_hal::TDisk_Address_Packet &dap) {
+	const char *src = static_cast<const char*>(dap.sectors);
+	uint64_t offset = dap.lba_index*mBytes_Per_Sector;
+	size_t remaining = static_cast<size_t>(mBytes_Per_Sector*dap.count);
+
+	while (remaining > 0) {
+		const size_t chunk_offset = static_cast<size_t>(offset % Chunk_Size);
+		const size_t len = (std::min)(remaining, Chunk_Size - chunk_offset);
+		auto &chunk = mChunks[static_cast<size_t>(offset / Chunk_Size)];
 
-		memcpy(&mDisk_Image[dap.lba_index*mBytes_Per_Sector], dap.sectors, mBytes_Per_Sector*dap.count);
-		Set_Status(context, kiv_hal::NDisk_Status::No_Error);
+		if (!chunk) {
+			//zapis samych nul do nealokovaneho bloku nic nemeni, takze pamet nezabirame
+			if (std::all_of(src, src + len, [](const char c) { return c == 0; })) {
+				src += len;
+				offset += len;
+				remaining -= len;
+				continue;
+			}
+
+			chunk.reset(new char[Chunk_Size]());
+			mAllocated_Chunks++;
+		}
+
+		memcpy(chunk.get() + chunk_offset, src, len);
+
+		src += len;
+		offset += len;
+		remaining -= len;
 	}
+
+	return kiv_hal::NDisk_Status::No_Error;
+}
+
+kiv_hal::NDisk_Status CRAM_Disk::Discard_Range(const kiv_hal::TDisk_Address_Packet &dap) {
+	uint64_t offset = dap.lba_index*mBytes_Per_Sector;
+	size_t remaining = static_cast<size_t>(mBytes_Per_Sector*dap.count);
+
+	while (remaining > 0) {
+		const size_t chunk_offset = static_cast<size_t>(offset % Chunk_Size);
+		const size_t len = (std::min)(remaining, Chunk_Size - chunk_offset);
+		auto &chunk = mChunks[static_cast<size_t>(offset / Chunk_Size)];
+
+		//cely blok vratime systemu, z castecne zahozeneho jen vynulujeme zahozenou cast
+		if (chunk) {
+			if (len == Chunk_Size) {
+				chunk.reset();
+				mAllocated_Chunks--;
+			}
+			else memset(chunk.get() + chunk_offset, 0, len);
+		}
+
+		offset += len;
+		remaining -= len;
+	}
+
+	return kiv_hal::NDisk_Status::No_Error;
+}
+
+bool CRAM_Disk::Concurrent_Reads() const {
+	return true;		//cteni nealokovanych bloku nic nealokuje
+}
+
+uint64_t CRAM_Disk::Resident_Size() {
+	return static_cast<uint64_t>(mAllocated_Chunks) * Chunk_Size;
+}
+
+CCompressed_Disk_Image::CCompressed_Disk_Image(const TCMOS_Drive_Parameters &cmos_parameters) : CDisk_Drive(cmos_parameters), mRead_Only(cmos_parameters.read_only), mCache_Capacity(cmos_parameters.compressed_cache_blocks) {
+	if (!CreateCompressor(COMPRESS_ALGORITHM_XPRESS_HUFF | COMPRESS_RAW, NULL, &mCompressor)) return;
+	if (!CreateDecompressor(COMPRESS_ALGORITHM_XPRESS_HUFF | COMPRESS_RAW, NULL, &mDecompressor)) return;
+
+	if (!std::experimental::filesystem::exists(cmos_parameters.disk_image))
+		if (mRead_Only || !Create_Container(cmos_parameters)) return;
+
+	auto open_mode = std::ios::binary | std::ios::in;
+	if (!mRead_Only) open_mode |= std::ios::out;
+	mImage.open(cmos_parameters.disk_image, open_mode);
+
+	THeader header;
+	if (!mImage.read(reinterpret_cast<char*>(&header), sizeof(header))) return;
+	if ((memcmp(header.magic, "KIVZ", sizeof(header.magic)) != 0) || (header.block_size != Block_Size)) return;		//mDisk_Size zustane 0
+
+	mIndex.resize(static_cast<size_t>((header.disk_size + Block_Size - 1) / Block_Size));
+	if (!mImage.read(reinterpret_cast<char*>(mIndex.data()), mIndex.size()*sizeof(TBlock))) return;
+
+	mImage.seekg(0, std::ios::end);
+	mFile_End = mImage.tellg();
+	mDisk_Size = static_cast<size_t>(header.disk_size);
+}
+
+CCompressed_Disk_Image::~CCompressed_Disk_Image() {
+	Flush();
+	if (mCompressor) CloseCompressor(mCompressor);
+	if (mDecompressor) CloseDecompressor(mDecompressor);
+}
+
+bool CCompressed_Disk_Image::Create_Container(const TCMOS_Drive_Parameters &cmos_parameters) {
+	std::ifstream source;
+	uint64_t disk_size = cmos_parameters.RAM_Disk_Size;		//bez zdrojoveho obrazu vytvorime prazdny disk velikosti RAM_Disk_Size
+	if (!cmos_parameters.compressed_source.empty()) {
+		source.open(cmos_parameters.compressed_source, std::ios::binary);
+		if (!source.is_open()) return false;
+		source.seekg(0, std::ios::end);
+		disk_size = source.tellg();
+		source.seekg(0, std::ios::beg);
+	}
+
+	THeader header;
+	memcpy(header.magic, "KIVZ", sizeof(header.magic));
+	header.block_size = Block_Size;
+	header.disk_size = disk_size;
+
+	mImage.open(cmos_parameters.disk_image, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+	if (!mImage.write(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+
+	//index zatim plny nulovych bloku, data pak pribyvaji za nim
+	mIndex.assign(static_cast<size_t>((disk_size + Block_Size - 1) / Block_Size), TBlock{ 0, 0, 0 });
+	mFile_End = sizeof(THeader) + mIndex.size()*sizeof(TBlock);
+	if (!Write_Index()) return false;
+
+	if (source.is_open()) {
+		std::vector<char> data(Block_Size);
+		for (uint64_t i = 0; i < mIndex.size(); i++) {
+			std::fill(data.begin(), data.end(), 0);		//posledni blok muze byt kratsi
+			source.read(data.data(), Block_Size);
+			if (!Store_Block(i, data)) return false;
+		}
+	}
+
+	const bool stored = Write_Index();
+	mImage.close();		//konstruktor soubor otevre znovu a nacte ho jako kazdy jiny kontejner
+	mIndex.clear();
+	return stored;
+}
+
+bool CCompressed_Disk_Image::Load_Block(const uint64_t index, std::vector<char> &data) {
+	const TBlock &block = mIndex[static_cast<size_t>(index)];
+	data.resize(Block_Size);
+
+	if (block.stored_size == 0) {
+		std::fill(data.begin(), data.end(), 0);
+		return true;
+	}
+
+	mImage.seekg(block.offset, std::ios::beg);
+	if (block.stored_size == Block_Size) return static_cast<bool>(mImage.read(data.data(), Block_Size));
+
+	std::vector<char> compressed(block.stored_size);
+	if (!mImage.read(compressed.data(), compressed.size())) return false;
+
+	SIZE_T decompressed_size = 0;
+	return Decompress(mDecompressor, compressed.data(), compressed.size(), data.data(), Block_Size, &decompressed_size) && (decompressed_size == Block_Size);
+}
+
+bool CCompressed_Disk_Image::Store_Block(const uint64_t index, const std::vector<char> &data) {
+	TBlock &block = mIndex[static_cast<size_t>(index)];
+	mIndex_Dirty = true;
+
+	if (std::all_of(data.begin(), data.end(), [](const char c) { return c == 0; })) {
+		block.stored_size = 0;		//misto v souboru si blok nechava pro pristi zapis
+		return true;
+	}
+
+	//nevejde-li se komprimovany blok do velikosti bloku, ulozime ho primo
+	std::vector<char> compressed(Block_Size);
+	SIZE_T compressed_size = 0;
+	const char *stored = compressed.data();
+	if (!Compress(mCompressor, data.data(), Block_Size, compressed.data(), compressed.size(), &compressed_size) || (compressed_size >= Block_Size)) {
+		stored = data.data();
+		compressed_size = Block_Size;
+	}
+
+	if (compressed_size > block.capacity) {
+		//puvodni misto zustane nevyuzite, kontejner se nezhutnuje
+		block.offset = mFile_End;
+		block.capacity = static_cast<uint32_t>(compressed_size);
+		mFile_End += compressed_size;
+	}
+	block.stored_size = static_cast<uint32_t>(compressed_size);
+
+	mImage.seekp(block.offset, std::ios::beg);
+	return static_cast<bool>(mImage.write(stored, compressed_size));
+}
+
+bool CCompressed_Disk_Image::Write_Index() {
+	mImage.seekp(sizeof(THeader), std::ios::beg);
+	mIndex_Dirty = false;
+	return static_cast<bool>(mImage.write(reinterpret_cast<const char*>(mIndex.data()), mIndex.size()*sizeof(TBlock)));
+}
+
+CCompressed_Disk_Image::TCached_Block *CCompressed_Disk_Image::Cached_Block(const uint64_t index, const bool overwrite) {
+	auto cached = mCache_Map.find(index);
+	if (cached != mCache_Map.end()) {
+		mCache.splice(mCache.begin(), mCache, cached->second);
+		return &mCache.front();
+	}
+
+	if (mCache.size() >= mCache_Capacity) {
+		TCached_Block &victim = mCache.back();
+		if (victim.dirty && !Store_Block(victim.index, victim.data)) return nullptr;
+		mCache_Map.erase(victim.index);
+		mCache.pop_back();
+	}
+
+	TCached_Block block{ index, std::vector<char>(Block_Size), false };
+	if (!overwrite && !Load_Block(index, block.data)) return nullptr;
+
+	mCache.push_front(std::move(block));
+	mCache_Map[index] = mCache.begin();
+	return &mCache.front();
+}
+
+kiv_hal::NDisk_Status CCompressed_Disk_Image::Read_Range(const kiv_hal::TDisk_Address_Packet &dap) {
+	char *dst = static_cast<char*>(dap.sectors);
+	uint64_t offset = dap.lba_index*mBytes_Per_Sector;
+	size_t remaining = static_cast<size_t>(dap.count*mBytes_Per_Sector);
+
+	while (remaining > 0) {
+		const size_t block_offset = static_cast<size_t>(offset % Block_Size);
+		const size_t len = (std::min)(remaining, Block_Size - block_offset);
+
+		const TCached_Block *block = Cached_Block(offset / Block_Size, false);
+		if (!block) return kiv_hal::NDisk_Status::Address_Mark_Not_Found_Or_Bad_Sector;
+		memcpy(dst, block->data.data() + block_offset, len);
+
+		dst += len;
+		offset += len;
+		remaining -= len;
+	}
+
+	return kiv_hal::NDisk_Status::No_Error;
+}
+
+kiv_hal::NDisk_Status CCompressed_Disk_Image::Write_Range(const kiv_hal::TDisk_Address_Packet &dap) {
+	if (mRead_Only) return kiv_hal::NDisk_Status::Fixed_Disk_Write_Fault_On_Selected_Drive;
+
+	const char *src = static_cast<const char*>(dap.sectors);
+	uint64_t offset = dap.lba_index*mBytes_Per_Sector;
+	size_t remaining = static_cast<size_t>(dap.count*mBytes_Per_Sector);
+
+	while (remaining > 0) {
+		const size_t block_offset = static_cast<size_t>(offset % Block_Size);
+		const size_t len = (std::min)(remaining, Block_Size - block_offset);
+
+		//cely prepisovany blok nema smysl rozbalovat
+		TCached_Block *block = Cached_Block(offset / Block_Size, len == Block_Size);
+		if (!block) return kiv_hal::NDisk_Status::Fixed_Disk_Write_Fault_On_Selected_Drive;
+		memcpy(block->data.data() + block_offset, src, len);
+		block->dirty = true;
+
+		src += len;
+		offset += len;
+		remaining -= len;
+	}
+
+	return kiv_hal::NDisk_Status::No_Error;
+}
+
+kiv_hal::NDisk_Status CCompressed_Disk_Image::Discard_Range(const kiv_hal::TDisk_Address_Packet &dap) {
+	if (mRead_Only) return kiv_hal::NDisk_Status::Fixed_Disk_Write_Fault_On_Selected_Drive;
+
+	uint64_t offset = dap.lba_index*mBytes_Per_Sector;
+	size_t remaining = static_cast<size_t>(dap.count*mBytes_Per_Sector);
+
+	while (remaining > 0) {
+		const size_t block_offset = static_cast<size_t>(offset % Block_Size);
+		const size_t len = (std::min)(remaining, Block_Size - block_offset);
+		const uint64_t index = offset / Block_Size;
+
+		if (len == Block_Size) {
+			//cely blok se stane nulovym, jeho misto v souboru zustane pro pristi zapis
+			const auto cached = mCache_Map.find(index);
+			if (cached != mCache_Map.end()) {
+				mCache.erase(cached->second);
+				mCache_Map.erase(cached);
+			}
+			mIndex[static_cast<size_t>(index)].stored_size = 0;
+			mIndex_Dirty = true;
+		}
+		else {
+			TCached_Block *block = Cached_Block(index, false);
+			if (!block) return kiv_hal::NDisk_Status::Fixed_Disk_Write_Fault_On_Selected_Drive;
+			memset(block->data.data() + block_offset, 0, len);
+			block->dirty = true;
+		}
+
+		offset += len;
+		remaining -= len;
+	}
+
+	return kiv_hal::NDisk_Status::No_Error;
+}
+
+uint64_t CCompressed_Disk_Image::Resident_Size() {
+	return static_cast<uint64_t>(mCache.size()) * Block_Size;
+}
+
+void CCompressed_Disk_Image::Flush() {
+	if (mRead_Only || !mImage.is_open()) return;
+
+	for (auto &block : mCache)
+		if (block.dirty && Store_Block(block.index, block.data)) block.dirty = false;
+
+	if (mIndex_Dirty) Write_Index();
+	mImage.flush();
+}
+
+COverlay_Disk::COverlay_Disk(const TCMOS_Drive_Parameters &cmos_parameters, std::unique_ptr<CDisk_Drive> base) : CDisk_Drive(cmos_parameters), mBase(std::move(base)), mDelta_Path(cmos_parameters.overlay_delta) {
+	mDisk_Size = static_cast<size_t>(mBase->Disk_Size());
+	if (!mDelta_Path.empty()) Load_Delta();
+}
+
+size_t COverlay_Disk::Record_Size() const {
+	return sizeof(uint64_t) + mBytes_Per_Sector;
+}
+
+void COverlay_Disk::Load_Delta() {
+	//soubor nejprve vytvorime, pokud neexistuje - fstream s in|out neexistujici soubor neotevre
+	if (!std::experimental::filesystem::exists(mDelta_Path)) std::ofstream{ mDelta_Path, std::ios::binary };
+	mDelta_File.open(mDelta_Path, std::ios::binary | std::ios::in | std::ios::out);
+
+	const size_t record_size = Record_Size();
+	std::vector<char> record(record_size);
+	uint64_t index = 0;
+	while (mDelta_File.read(record.data(), record_size)) {
+		const uint64_t lba = *reinterpret_cast<uint64_t*>(record.data());
+		mDelta_Index[lba] = index++;		//pozdejsi zaznam stejneho sektoru ma prednost
+	}
+
+	mDelta_File.clear();		//konec souboru nastavil eof, dalsi prenosy uz ale musi projit
+
+	//zaznamu muze byt vic nez sektoru v indexu - stejny sektor mohl byt zapsan vicekrat, zadny z nich nesmime prepsat
+	mDelta_Records = static_cast<uint64_t>(std::experimental::filesystem::file_size(mDelta_Path)) / record_size;
+}
+
+kiv_hal::NDisk_Status COverlay_Disk::Read_Delta(const uint64_t record, char *sector) {
+	if (!mDelta_File.is_open()) {
+		memcpy(sector, &mDelta_Memory[static_cast<size_t>(record*mBytes_Per_Sector)], mBytes_Per_Sector);
+		return kiv_hal::NDisk_Status::No_Error;
+	}
+
+	mDelta_File.seekg(record*Record_Size() + sizeof(uint64_t), std::ios::beg);
+	mDelta_File.read(sector, mBytes_Per_Sector);
+	return mDelta_File.gcount() == static_cast<std::streamsize>(mBytes_Per_Sector) ? kiv_hal::NDisk_Status::No_Error : kiv_hal::NDisk_Status::Address_Mark_Not_Found_Or_Bad_Sector;
+}
+
+kiv_hal::NDisk_Status COverlay_Disk::Write_Delta(const uint64_t record, const uint64_t lba, const char *sector) {
+	if (!mDelta_File.is_open()) {
+		const size_t offset = static_cast<size_t>(record*mBytes_Per_Sector);
+		if (offset >= mDelta_Memory.size()) mDelta_Memory.resize(offset + mBytes_Per_Sector);
+		memcpy(&mDelta_Memory[offset], sector, mBytes_Per_Sector);
+		return kiv_hal::NDisk_Status::No_Error;
+	}
+
+	mDelta_File.seekp(record*Record_Size(), std::ios::beg);
+	mDelta_File.write(reinterpret_cast<const char*>(&lba), sizeof(lba));
+	mDelta_File.write(sector, mBytes_Per_Sector);
+	return mDelta_File.good() ? kiv_hal::NDisk_Status::No_Error : kiv_hal::NDisk_Status::Fixed_Disk_Write_Fault_On_Selected_Drive;
+}
+
+kiv_hal::NDisk_Status COverlay_Disk::Read_Range(const kiv_hal::TDisk_Address_Packet &dap) {
+	char *dst = static_cast<char*>(dap.sectors);
+	uint64_t i = 0;
+
+	while (i < dap.count) {
+		const auto delta = mDelta_Index.find(dap.lba_index + i);
+		if (delta != mDelta_Index.end()) {
+			const auto status = Read_Delta(delta->second, dst + i*mBytes_Per_Sector);
+			if (status != kiv_hal::NDisk_Status::No_Error) return status;
+			i++;
+			continue;
+		}
+
+		//nezmenene sektory za sebou precteme ze zakladniho obrazu jednim prenosem
+		uint64_t run = 1;
+		while ((i + run < dap.count) && (mDelta_Index.find(dap.lba_index + i + run) == mDelta_Index.end())) run++;
+
+		kiv_hal::TDisk_Address_Packet base_dap;
+		base_dap.lba_index = dap.lba_index + i;
+		base_dap.count = run;
+		base_dap.sectors = dst + i*mBytes_Per_Sector;
+		const auto status = mBase->Transfer(kiv_hal::NDisk_IO::Read_Sectors, base_dap);
+		if (status != kiv_hal::NDisk_Status::No_Error) return status;
+
+		i += run;
+	}
+
+	return kiv_hal::NDisk_Status::No_Error;
+}
+
+kiv_hal::NDisk_Status COverlay_Disk::Write_Range(const kiv_hal::TDisk_Address_Packet &dap) {
+	const char *src = static_cast<const char*>(dap.sectors);
+
+	for (uint64_t i = 0; i < dap.count; i++) {
+		const uint64_t lba = dap.lba_index + i;
+
+		//prepsany sektor pouzije svuj puvodni zaznam, novy se prida na konec rozdilu
+		auto delta = mDelta_Index.find(lba);
+		const uint64_t record = delta != mDelta_Index.end() ? delta->second : mDelta_Records;
+
+		const auto status = Write_Delta(record, lba, src + i*mBytes_Per_Sector);
+		if (status != kiv_hal::NDisk_Status::No_Error) return status;		//nedopsany zaznam prepise pristi pridany
+
+		if (delta == mDelta_Index.end()) {
+			mDelta_Index[lba] = record;
+			mDelta_Records++;
+		}
+	}
+
+	return kiv_hal::NDisk_Status::No_Error;
+}
+
+kiv_hal::NDisk_Status COverlay_Disk::Discard_Range(const kiv_hal::TDisk_Address_Packet &dap) {
+	//nuly by se do rozdilu musely zapsat jako nove zaznamy a zaklad je jen pro cteni, zahozene sektory si proto ponechaji obsah
+	return kiv_hal::NDisk_Status::No_Error;
+}
+
+uint64_t COverlay_Disk::Resident_Size() {
+	return mDelta_Memory.capacity() + mBase->Resident_Size();
+}
+
+void COverlay_Disk::Flush() {
+	if (mDelta_File.is_open()) mDelta_File.flush();
+}
+
+kiv_hal::NDisk_Status COverlay_Disk::Discard_Delta() {
+	mDelta_Index.clear();
+	mDelta_Records = 0;
+	std::vector<char>().swap(mDelta_Memory);
+
+	if (mDelta_File.is_open()) {
+		//soubor jen zkratime na nulu, zakladni obraz se vubec nekopiruje
+		mDelta_File.close();
+		mDelta_File.open(mDelta_Path, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+		if (!mDelta_File.is_open()) return kiv_hal::NDisk_Status::Fixed_Disk_Write_Fault_On_Selected_Drive;
+	}
+
+	return kiv_hal::NDisk_Status::No_Error;
+}
+
+CDisk_Queue::CDisk_Queue(CDisk_Drive &drive) : mDrive(drive) {
+	mWorker = std::thread(&CDisk_Queue::Worker, this);
+}
+
+CDisk_Queue::~CDisk_Queue() {
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		mTerminate = true;
+	}
+	mSubmitted_Changed.notify_all();
+	mWorker.join();
+}
+
+void CDisk_Queue::Worker() {
+	std::unique_lock<std::mutex> lock(mLock);
+
+	while (true) {
+		mSubmitted_Changed.wait(lock, [this] { return mTerminate || !mSubmitted.empty(); });
+		if (mSubmitted.empty()) break;		//koncime az s prazdnou frontou
+
+		//prevezmeme az Queue_Depth pozadavku, ale jen dokud se zadny neprekryva s uz prevzatymi
+		std::vector<kiv_hal::TDisk_Request*> batch;
+		while (!mSubmitted.empty() && (batch.size() < mDrive.Queue_Depth())) {
+			const kiv_hal::TDisk_Request *next = mSubmitted.front();
+			const bool overlaps = std::any_of(batch.begin(), batch.end(), [next](const kiv_hal::TDisk_Request *taken) {
+				return (next->dap.lba_index < taken->dap.lba_index + taken->dap.count) && (taken->dap.lba_index < next->dap.lba_index + next->dap.count);
+			});
+			if (overlaps) break;
+
+			batch.push_back(mSubmitted.front());
+			mSubmitted.pop_front();
+		}
+		mIn_Progress += batch.size();
+
+		//samotny prenos uz probiha bez zamku fronty, aby mezitim slo zaradit dalsi pozadavky
+		lock.unlock();
+		mDrive.Transfer_Batch(batch);
+		lock.lock();
+
+		mIn_Progress -= batch.size();
+		mCompleted.insert(mCompleted.end(), batch.begin(), batch.end());
+		mCompleted_Changed.notify_all();
+	}
+}
+
+void CDisk_Queue::Submit_Requests(kiv_hal::TRegisters &context) {
+	kiv_hal::TDisk_Request *requests = reinterpret_cast<kiv_hal::TDisk_Request*>(context.rdi.r);
+	const size_t count = static_cast<size_t>(context.rcx.r);
+
+	for (size_t i = 0; i < count; i++)
+		if ((requests[i].operation != kiv_hal::NDisk_IO::Read_Sectors) && (requests[i].operation != kiv_hal::NDisk_IO::Write_Sectors)) {
+			context.flags.carry = 1;
+			context.rax.x = static_cast<uint16_t>(kiv_hal::NDisk_Status::Bad_Command);
+			return;
+		}
+
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		for (size_t i = 0; i < count; i++)
+			mSubmitted.push_back(&requests[i]);
+	}
+	mSubmitted_Changed.notify_one();
+
+	context.flags.carry = 0;
+}
+
+void CDisk_Queue::Reap_Completions(kiv_hal::TRegisters &context) {
+	kiv_hal::TDisk_Request **completed = reinterpret_cast<kiv_hal::TDisk_Request**>(context.rdi.r);
+	const size_t capacity = static_cast<size_t>(context.rcx.r);
+	const bool wait = context.rbx.l != 0;
+
+	std::unique_lock<std::mutex> lock(mLock);
+	if (wait && (capacity > 0))		//neni-li nic rozpracovano, nemame na co cekat
+		mCompleted_Changed.wait(lock, [this] { return !mCompleted.empty() || (mSubmitted.empty() && (mIn_Progress == 0)); });
+
+	size_t reaped = 0;
+	while ((reaped < capacity) && !mCompleted.empty()) {
+		completed[reaped++] = mCompleted.front();
+		mCompleted.pop_front();
+	}
+
+	context.flags.carry = 0;
+	context.rax.r = reaped;
 }
\ No newline at end of file
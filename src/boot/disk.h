@@ -3,8 +3,20 @@
 #include "cmos.h"
 #include "../api/hal.h"
 
+#include <Windows.h>
+#include <compressapi.h>
 #include <fstream>
 #include <vector>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <unordered_map>
+#include <string>
+#include <list>
+#include <set>
 
 class CDisk_Drive {
 protected:
@@ -14,35 +26,267 @@ protected:
 		bool Check_DAP(kiv_hal::TRegisters &context);	
 		//vrati true, pokud by cteni/zapis nezpusobilo pristup za velikost disku
 		//v takovem pripade vraci false a nastavi chybu
+	bool Check_Range(const kiv_hal::TDisk_Address_Packet &dap) const;
+		//vrati true, pokud usek sektoru lezi cely na disku
+
+	virtual kiv_hal::NDisk_Status Read_Range(const kiv_hal::TDisk_Address_Packet &dap) = 0;
+	virtual kiv_hal::NDisk_Status Write_Range(const kiv_hal::TDisk_Address_Packet &dap) = 0;
+		//vlastni prenos jednoho souvisleho useku sektoru, rozsah uz je zkontrolovany
+	virtual kiv_hal::NDisk_Status Discard_Range(const kiv_hal::TDisk_Address_Packet &dap);
+		//uvolni usek sektoru, vychozi disk ho jen prepise nulami
+	uint64_t mDiscarded_Sectors = 0;
+
+	std::shared_timed_mutex mIO_Lock;		//zapisy a sprava disku se nesmi prekryvat s nicim, cteni jen je-li Shared_Reads
+	std::mutex mStatistics_Lock;			//pocitadla statistik, ktera meni i soubezna cteni
+	virtual bool Concurrent_Reads() const;
+		//true, pokud Read_Range nemeni zadny stav disku a smi tak bezet soubezne
+	bool Shared_Reads() const;
+
+	kiv_hal::TDisk_Statistics mStatistics{};
+	uint64_t mNext_Sequential_Lba = 0;		//prenos zacinajici na tomto sektoru navazuje na predchozi
+	kiv_hal::NDisk_Status Measured_Range(const kiv_hal::NDisk_IO operation, const kiv_hal::TDisk_Address_Packet &dap, const bool new_command);
+		//provede prenos, pozdrzi ho podle casoveho modelu a zapocita ho do statistik, volat jen se zamcenym mIO_Lock
+		//new_command je false pro dalsi useky tehoz prikazu, ty uz neplati rezii prikazu
+
+	kiv_hal::NDisk_Status Device_Range(const kiv_hal::NDisk_IO operation, const kiv_hal::TDisk_Address_Packet &dap, const bool new_command);
+		//prenos az na zarizeni, tj. mimo zapisovou cache, vcetne casoveho modelu
+
+	//zapisova cache sektoru, odlozene zapisy se slucuji a zapisuji serazene podle lba
+	struct TCached_Sector {
+		size_t slot;								//kde v mCache_Data sektor lezi
+		bool dirty;
+		std::list<uint64_t>::iterator lru;
+	};
+	size_t mCache_Capacity = 0;						//v sektorech, 0 znamena bez cache
+	std::vector<char> mCache_Data;
+	std::vector<size_t> mCache_Free_Slots;
+	std::unordered_map<uint64_t, TCached_Sector> mCache;
+	std::list<uint64_t> mCache_LRU;					//od naposledy pouziteho
+	std::set<uint64_t> mCache_Dirty;				//serazene, aby zpetny zapis sel po souvislych usecich
+	kiv_hal::TDisk_Cache_Statistics mCache_Statistics{};
+
+	kiv_hal::NDisk_Status Cached_Range(const kiv_hal::NDisk_IO operation, const kiv_hal::TDisk_Address_Packet &dap, const bool new_command);
+	char *Cache_Sector(const uint64_t lba, kiv_hal::NDisk_Status &status);
+		//vrati misto pro sektor v cache, pripadne uvolni nejdele nepouzity sektor; bez mista vraci nullptr a nastavi status
+	kiv_hal::NDisk_Status Write_Back();			//zapise vsechny spinave sektory, volat se zamcenym mIO_Lock
+	void Drop_Cached(const kiv_hal::TDisk_Address_Packet &dap);		//zahodi sektory z cache vcetne neulozenych zapisu
+	void Invalidate_Cache();					//zahodi vsechno vcetne neulozenych zapisu
+
+	TCMOS_Disk_Timing mTiming;
+	bool mTiming_Enabled = false;
+	uint64_t mHead_Lba = 0;				//kde hlava skoncila po poslednim prenosu
+	uint64_t mVirtual_Clock_us = 0;
+	int64_t mDelay_Debt_us = 0;			//dosud neodspane zpozdeni, spime az po celych milisekundach kvuli presnosti Sleep
+	uint64_t Modeled_Time_us(const kiv_hal::TDisk_Address_Packet &dap, const bool new_command);
+	void Inject_Delay(const uint64_t modeled_us, const std::chrono::steady_clock::time_point &start);
+
+	struct TSnapshot {
+		std::string name;
+		std::vector<bool> changed;		//bitmapa sektoru zmenenych od porizeni snimku
+		std::vector<uint64_t> lbas;		//zmenene sektory v poradi prvniho zapisu
+		std::vector<char> originals;	//jejich obsah v okamziku porizeni snimku, ve stejnem poradi
+	};
+	std::vector<TSnapshot> mSnapshots;		//od nejstarsiho, takze navraceni zahazuje konec
+
+	kiv_hal::NDisk_Status Preserve_Originals(const kiv_hal::TDisk_Address_Packet &dap);
+		//schova puvodni obsah sektoru, ktere jeste nektery snimek nema
+		//cena je tak umerna jen poctu sektoru zmenenych od snimku, ne velikosti disku
+	kiv_hal::NDisk_Status Tracked_Write_Range(const kiv_hal::TDisk_Address_Packet &dap);		//Preserve_Originals a Write_Range
+	std::vector<TSnapshot>::iterator Find_Snapshot(const std::string &name);
+	kiv_hal::NDisk_Status Rollback_Snapshot(const std::vector<TSnapshot>::iterator snapshot);
+	kiv_hal::NDisk_Status Export_Snapshot_Delta(const TSnapshot &snapshot, const char *delta_path);
 public:
 	CDisk_Drive(const TCMOS_Drive_Parameters &cmos_parameters);
+	virtual ~CDisk_Drive();
 	void Drive_Parameters(kiv_hal::TRegisters &context);
 
-	virtual void Read_Sectors(kiv_hal::TRegisters &context) = 0;
-	virtual void Write_Sectors(kiv_hal::TRegisters &context) = 0;	
+	kiv_hal::NDisk_Status Transfer(const kiv_hal::NDisk_IO operation, const kiv_hal::TDisk_Address_Packet &dap);
+		//zkontroluje rozsah a provede jeden prenos, operace je NDisk_IO::Read_Sectors nebo NDisk_IO::Write_Sectors
+	void Transfer_Batch(std::vector<kiv_hal::TDisk_Request*> &batch);
+		//provede pozadavky prevzate z fronty najednou, seradi je podle lba a rezii prikazu zaplati jen jednou
+	size_t Queue_Depth() const;
+
+	void Read_Sectors(kiv_hal::TRegisters &context);
+	void Write_Sectors(kiv_hal::TRegisters &context);
+	void Read_Sectors_Vectored(kiv_hal::TRegisters &context);
+	void Write_Sectors_Vectored(kiv_hal::TRegisters &context);
+	void Drive_Statistics(kiv_hal::TRegisters &context);
+	void Discard_Changes(kiv_hal::TRegisters &context);
+	void Snapshot(kiv_hal::TRegisters &context);
+	void Flush_Cache(kiv_hal::TRegisters &context);
+	void Discard_Sectors(kiv_hal::TRegisters &context);
+	kiv_hal::NDisk_Status Synchronize();		//zapise zapisovou cache a zavola Flush
+	void Print_Statistics(const uint8_t drive_index);
+	virtual uint64_t Resident_Size();		//kolik pameti disk zabira v procesu, obrazy na disku nic
+
+	virtual void Flush();		//zapise vsechna rozpracovana data az na hostitelsky disk
+	virtual kiv_hal::NDisk_Status Discard_Delta();		//zahodi zmeny proti zakladnimu obrazu, volat se zamcenym mIO_Lock
+	uint64_t Disk_Size() const;
 	
 };
 
 class CDisk_Image : public CDisk_Drive {
 protected:
-	std::fstream mDisk_Image;
+	HANDLE mImage_File = INVALID_HANDLE_VALUE;
+
+	bool Positional_IO(const bool write, char *buffer, uint64_t offset, uint64_t bytes);
+		//prenos na danou pozici souboru bez sdileneho ukazatele pozice
+	bool Device_Control(const DWORD code, void *input, const DWORD input_size);
+
+	virtual bool Concurrent_Reads() const final;
+	virtual kiv_hal::NDisk_Status Read_Range(const kiv_hal::TDisk_Address_Packet &dap) final;
+	virtual kiv_hal::NDisk_Status Write_Range(const kiv_hal::TDisk_Address_Packet &dap) final;
+	virtual kiv_hal::NDisk_Status Discard_Range(const kiv_hal::TDisk_Address_Packet &dap) final;		//vyrazi v souboru diru
 public:
 	CDisk_Image(const TCMOS_Drive_Parameters &cmos_parameters);
+	virtual ~CDisk_Image();
 	
-	virtual void Read_Sectors(kiv_hal::TRegisters &context )final;
-	virtual void Write_Sectors(kiv_hal::TRegisters &context) final;
+	virtual void Flush() final;
 };
 
 
+class CMapped_Disk_Image : public CDisk_Drive {
+protected:
+	HANDLE mImage_File = INVALID_HANDLE_VALUE;
+	HANDLE mImage_Mapping = NULL;
+	char *mView = nullptr;					//cely obraz disku namapovany do pameti, sektory pak jenom kopirujeme
+	bool mRead_Only;
+
+	virtual bool Concurrent_Reads() const final;
+	virtual kiv_hal::NDisk_Status Read_Range(const kiv_hal::TDisk_Address_Packet &dap) final;
+	virtual kiv_hal::NDisk_Status Write_Range(const kiv_hal::TDisk_Address_Packet &dap) final;
+public:
+	CMapped_Disk_Image(const TCMOS_Drive_Parameters &cmos_parameters);
+	virtual ~CMapped_Disk_Image();
+
+	virtual void Flush() final;
+};
+
+
+//ridky RAM disk, pamet se alokuje po blocich az pri prvnim zapisu do nich
+//nikdy nezapsane sektory se ctou jako nuly
 class CRAM_Disk : public CDisk_Drive {
 protected:
-	std::vector<char> mDisk_Image;
+	const static size_t Chunk_Size = 64 * 1024;		//alokacni granularita Windows
+	std::vector<std::unique_ptr<char[]>> mChunks;
+	size_t mAllocated_Chunks = 0;
+
+	virtual bool Concurrent_Reads() const final;
+	virtual kiv_hal::NDisk_Status Read_Range(const kiv_hal::TDisk_Address_Packet &dap) final;
+	virtual kiv_hal::NDisk_Status Write_Range(const kiv_hal::TDisk_Address_Packet &dap) final;
+	virtual kiv_hal::NDisk_Status Discard_Range(const kiv_hal::TDisk_Address_Packet &dap) final;		//cele bloky uvolni
 public:
 	CRAM_Disk(const TCMOS_Drive_Parameters &cmos_parameters);
+	virtual uint64_t Resident_Size() final;
+};
+
+
+//obraz disku slozeny z nezavisle komprimovanych bloku pevne velikosti
+//soubor zacina hlavickou, za ni je index bloku a pak data bloku
+//bloky se ctou pres malou cache rozbalenych bloku, ktera je pri vyhozeni nebo Flush znovu zkomprimuje
+class CCompressed_Disk_Image : public CDisk_Drive {
+protected:
+	struct THeader {
+		char magic[4];
+		uint32_t block_size;
+		uint64_t disk_size;
+	};
+
+	struct TBlock {
+		uint64_t offset;			//kde v souboru blok zacina
+		uint32_t stored_size;		//0 pro nulovy blok, block_size pro nekomprimovatelny blok ulozeny primo
+		uint32_t capacity;			//kolik mista v souboru blok ma, mensi prepis se vejde na stejne misto
+	};
+
+	struct TCached_Block {
+		uint64_t index;
+		std::vector<char> data;
+		bool dirty;
+	};
+
+	const static uint32_t Block_Size = 64 * 1024;
+
+	std::fstream mImage;
+	bool mRead_Only;
+	std::vector<TBlock> mIndex;
+	uint64_t mFile_End = 0;				//dalsi blok, ktery se nevejde na sve misto, se zapise sem
+	bool mIndex_Dirty = false;
+
+	size_t mCache_Capacity;
+	std::list<TCached_Block> mCache;	//od naposledy pouziteho
+	std::unordered_map<uint64_t, std::list<TCached_Block>::iterator> mCache_Map;
+
+	COMPRESSOR_HANDLE mCompressor = NULL;
+	DECOMPRESSOR_HANDLE mDecompressor = NULL;
+
+	bool Create_Container(const TCMOS_Drive_Parameters &cmos_parameters);
+	bool Load_Block(const uint64_t index, std::vector<char> &data);
+	bool Store_Block(const uint64_t index, const std::vector<char> &data);
+	bool Write_Index();
+	TCached_Block *Cached_Block(const uint64_t index, const bool overwrite);
+		//vrati blok z cache, pripadne ho nacte a vyhodi nejdele nepouzity; overwrite preskoci rozbaleni
+		//vraci nullptr, pokud blok nejde precist nebo vyhozeny blok zapsat
+
+	virtual kiv_hal::NDisk_Status Read_Range(const kiv_hal::TDisk_Address_Packet &dap) final;
+	virtual kiv_hal::NDisk_Status Write_Range(const kiv_hal::TDisk_Address_Packet &dap) final;
+	virtual kiv_hal::NDisk_Status Discard_Range(const kiv_hal::TDisk_Address_Packet &dap) final;		//cele bloky oznaci jako nulove
+public:
+	CCompressed_Disk_Image(const TCMOS_Drive_Parameters &cmos_parameters);
+	virtual ~CCompressed_Disk_Image();
+	virtual uint64_t Resident_Size() final;
+
+	virtual void Flush() final;
+};
+
+
+//prekryvny disk: zakladni obraz se jen cte a zapsane sektory se ukladaji do rozdilu
+//zahozenim rozdilu se disk vrati do puvodniho stavu, aniz by se cokoliv kopirovalo
+class COverlay_Disk : public CDisk_Drive {
+protected:
+	std::unique_ptr<CDisk_Drive> mBase;
+	std::unordered_map<uint64_t, uint64_t> mDelta_Index;		//lba -> poradi zaznamu v rozdilu
+	std::experimental::filesystem::path mDelta_Path;
+	std::fstream mDelta_File;				//zaznam je lba a za nim obsah sektoru
+	std::vector<char> mDelta_Memory;		//bez rozdiloveho souboru jsou v pameti jen obsahy sektoru
+	uint64_t mDelta_Records = 0;			//pocet zaznamu v rozdilu vcetne prepsanych, novy zaznam se pridava za ne
+
+	size_t Record_Size() const;
+	void Load_Delta();		//obnovi index ze zaznamu, ktere v rozdilovem souboru zustaly z minula
+	kiv_hal::NDisk_Status Read_Delta(const uint64_t record, char *sector);
+	kiv_hal::NDisk_Status Write_Delta(const uint64_t record, const uint64_t lba, const char *sector);
+
+	virtual kiv_hal::NDisk_Status Read_Range(const kiv_hal::TDisk_Address_Packet &dap) final;
+	virtual kiv_hal::NDisk_Status Write_Range(const kiv_hal::TDisk_Address_Packet &dap) final;
+	virtual kiv_hal::NDisk_Status Discard_Range(const kiv_hal::TDisk_Address_Packet &dap) final;		//nedela nic, rozdil by jen rostl
+public:
+	COverlay_Disk(const TCMOS_Drive_Parameters &cmos_parameters, std::unique_ptr<CDisk_Drive> base);
+	virtual uint64_t Resident_Size() final;
+
+	virtual void Flush() final;
+	virtual kiv_hal::NDisk_Status Discard_Delta() final;
+};
+
+
+//asynchronni fronta pozadavku jednoho disku, obsluhuje ji vlastni pracovni vlakno
+class CDisk_Queue {
+protected:
+	CDisk_Drive &mDrive;
+	std::mutex mLock;
+	std::condition_variable mSubmitted_Changed, mCompleted_Changed;
+	std::deque<kiv_hal::TDisk_Request*> mSubmitted, mCompleted;
+	size_t mIn_Progress = 0;		//pozadavky vyzvednute vlaknem, ale dosud nedokoncene
+	bool mTerminate = false;
+	std::thread mWorker;
+
+	void Worker();
+public:
+	CDisk_Queue(CDisk_Drive &drive);
+	~CDisk_Queue();		//nejprve dokonci vsechny zarazene pozadavky, teprve pak ukonci vlakno
 
-	virtual void Read_Sectors(kiv_hal::TRegisters &context) final;
-	virtual void Write_Sectors(kiv_hal::TRegisters &context) final;
+	void Submit_Requests(kiv_hal::TRegisters &context);
+	void Reap_Completions(kiv_hal::TRegisters &context);
 };
 
 
-void __stdcall Disk_Handler(kiv_hal::TRegisters &context);
\ No newline at end of file
+void __stdcall Disk_Handler(kiv_hal::TRegisters &context);
+void Shutdown_Disks();		//pri vypnuti pocitace zapise rozpracovana data vsech disku a uvolni je
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include "../api/hal.h"
 #include "idt.h"
 #include "keyboard.h"	
+#include "disk.h"
 
 bool Setup_HW() {
 	if (!Init_Keyboard()) {
@@ -41,6 +42,7 @@ int __cdecl main() {
 	
 	//a az simulovany OS skonci, uvolnime zdroje z pameti
 	FreeLibrary(kernel);
+	Shutdown_Disks();
 	TlsFree(kiv_hal::Expected_Tls_IDT_Index);
 
 	return 0;
@@ -2,6 +2,7 @@
 #include "../api/api.h"
 
 #include <string.h>
+#include <algorithm>
 
 namespace kiv_fs_linked_entries {
 	// LE entry status
@@ -9,246 +10,1615 @@ namespace kiv_fs_linked_entries {
 	const uint32_t ENTRY_RESERVED = static_cast<uint32_t>(-3);
 	const uint32_t ENTRY_EOF = static_cast<uint32_t>(-4);
 
-	const size_t MAX_DIR_ENTRIES = 21;
 	const size_t MAX_FILENAME_SIZE = 11;
 	const char *LE_NAME = "le";
 	const TLE_Dir_Entry root_dir_entry{ "\\" };
 
+	// Dentry cache key of the root (any cluster number could be the first cluster of a subdirectory)
+	const TLE_Entry ROOT_DENTRY_KEY = static_cast<TLE_Entry>(-1);
+	// The dentry cache is emptied when it grows over this number of entries
+	const size_t DENTRY_CACHE_CAPACITY = 4096;
+
+	TLE_Name Make_Name(const char *filename, size_t length) {
+		TLE_Name name{};
+		memcpy(name.name, filename, (std::min)(length, sizeof(name.name)));
+		return name;
+	}
+
+	TLE_Name Make_Name(const std::string &filename) {
+		return Make_Name(filename.c_str(), filename.length());
+	}
+
+	TLE_Name Make_Name(const char (&filename)[12]) {
+		return Make_Name(filename, strnlen(filename, sizeof(filename)));
+	}
+
+	bool TLE_Name::operator==(const TLE_Name &other) const {
+		return strncmp(name, other.name, sizeof(name)) == 0;
+	}
+
+	size_t TLE_Name_Hash::operator()(const TLE_Name &name) const {
+		// FNV-1a over the characters of the name
+		size_t hash = 2166136261u;
+		for (size_t i = 0; i < sizeof(name.name) && name.name[i] != '\0'; i++) {
+			hash = (hash ^ static_cast<unsigned char>(name.name[i])) * 16777619u;
+		}
+		return hash;
+	}
+
+	// Index of the lowest set bit, word must not be zero
+	size_t Lowest_Set_Bit(uint64_t word) {
+		size_t index = 0;
+		while ((word & 1) == 0) {
+			word >>= 1;
+			index++;
+		}
+		return index;
+	}
+
+	// How often dirty metadata is written back by the mount's sync thread
+	const std::chrono::milliseconds SYNC_INTERVAL(1000);
+
+	// Readahead window of a sequentially read file, in clusters. Mount also limits it to a quarter of its cache.
+	const size_t READAHEAD_MIN_CLUSTERS = 4;
+	const size_t READAHEAD_MAX_CLUSTERS = 64;
+
+	// Journal region magics (superblock and journal header, transaction descriptor, transaction commit)
+	const char JOURNAL_MAGIC[4] = "lej";
+	const char JOURNAL_DESCRIPTOR_MAGIC[4] = "ljd";
+	const char JOURNAL_COMMIT_MAGIC[4] = "ljc";
+	// Size of the journal region of newly formatted disks, at most this fraction of the disk
+	const size_t DEFAULT_JOURNAL_CLUSTERS = 64;
+	const size_t JOURNAL_DISK_FRACTION = 32;
+	// Header, descriptor, commit and at least one logged cluster
+	const size_t MIN_JOURNAL_CLUSTERS = 4;
+
+	// FNV-1a, continues from the hash of the preceding data
+	uint32_t Journal_Checksum(uint32_t hash, const char *data, size_t size) {
+		for (size_t i = 0; i < size; i++) {
+			hash = (hash ^ static_cast<unsigned char>(data[i])) * 16777619u;
+		}
+		return hash;
+	}
+	const uint32_t JOURNAL_CHECKSUM_SEED = 2166136261u;
+
 
 #pragma region IO Utils
-	CLE_Utils::CLE_Utils(TSuperblock &sb, kiv_vfs::TDisk_Number disk_number, std::recursive_mutex *fs_lock)
-		: mSb(sb), mDisk_number(disk_number), mFs_lock(fs_lock)
+	CLE_Utils::CLE_Utils(TSuperblock &sb, kiv_vfs::TDisk_Number disk_number, size_t cache_capacity)
+		: mSb(sb), mDisk_number(disk_number), mCache_capacity(cache_capacity)
+	{
+	}
+
+	CLE_Utils::CLE_Utils(kiv_vfs::TDisk_Number disk_number, size_t cache_capacity)
+		: mSb(TSuperblock{}), mDisk_number(disk_number), mCache_capacity(cache_capacity)
 	{
 	}
 
-	CLE_Utils::CLE_Utils(kiv_vfs::TDisk_Number disk_number, std::recursive_mutex *fs_lock)
-		: mSb(TSuperblock{}), mDisk_number(disk_number), mFs_lock(fs_lock)
-	{
+	bool CLE_Utils::Write_To_Disk(char *sectors, uint64_t first_sector, uint64_t num_of_sectors) {
+		Wait_For_Async(first_sector, num_of_sectors);
+
+		kiv_hal::TRegisters regs;
+		kiv_hal::TDisk_Address_Packet dap;
+
+		dap.lba_index = first_sector;
+		dap.count = num_of_sectors;
+		dap.sectors = sectors;
+
+		regs.rax.h = static_cast<decltype(regs.rax.h)>(kiv_hal::NDisk_IO::Write_Sectors);;
+		regs.rdx.l = static_cast<decltype(regs.rdx.l)>(mDisk_number);
+		regs.rdi.r = reinterpret_cast<decltype(regs.rdi.r)>(&dap);
+
+		kiv_hal::Call_Interrupt_Handler(kiv_hal::NInterrupt::Disk_IO, regs);
+
+		return (regs.flags.carry == 0);
+	}
+
+	bool CLE_Utils::Read_From_Disk(char *buffer, uint64_t first_sector, uint64_t num_of_sectors) {
+		Wait_For_Async(first_sector, num_of_sectors);
+
+		kiv_hal::TRegisters regs;
+		kiv_hal::TDisk_Address_Packet dap;
+
+		dap.lba_index = first_sector;
+		dap.count = num_of_sectors;
+		dap.sectors = buffer;
+
+		regs.rax.h = static_cast<decltype(regs.rax.h)>(kiv_hal::NDisk_IO::Read_Sectors);;
+		regs.rdx.l = static_cast<decltype(regs.rdx.l)>(mDisk_number);
+		regs.rdi.r = reinterpret_cast<decltype(regs.rdi.r)>(&dap);
+
+		kiv_hal::Call_Interrupt_Handler(kiv_hal::NInterrupt::Disk_IO, regs);
+
+		return (regs.flags.carry == 0);
+	}
+
+	bool CLE_Utils::Write_Clusters(char *clusters, uint64_t first_cluster, uint64_t num_of_clusters, bool metadata) {
+		return Cached_Write(Contiguous_Buffers(clusters, num_of_clusters), Cluster_Range(first_cluster, num_of_clusters), metadata);
+	}
+
+	bool CLE_Utils::Read_Clusters(char *buffer, uint64_t first_cluster, uint64_t num_of_clusters) {
+		return Cached_Read(Contiguous_Buffers(buffer, num_of_clusters), Cluster_Range(first_cluster, num_of_clusters));
+	}
+
+	bool CLE_Utils::Write_Data_Cluster(char *clusters, TLE_Entry le_entry) {
+		return Write_Clusters(clusters, mSb.data_first_cluster + le_entry, 1, false);
+	}
+
+	bool CLE_Utils::Read_Data_Cluster(char *buffer, TLE_Entry le_entry) {
+		return Read_Clusters(buffer, mSb.data_first_cluster + le_entry, 1);
+	}
+
+	bool CLE_Utils::Write_Data_Clusters(char *clusters, const std::vector<TLE_Entry> &le_entries) {
+		return Cached_Write(Contiguous_Buffers(clusters, le_entries.size()), Data_Clusters(le_entries), false);
+	}
+
+	bool CLE_Utils::Read_Data_Clusters(char *buffer, const std::vector<TLE_Entry> &le_entries) {
+		return Cached_Read(Contiguous_Buffers(buffer, le_entries.size()), Data_Clusters(le_entries));
+	}
+
+	bool CLE_Utils::Write_Data_Clusters(const std::vector<char *> &clusters, const std::vector<TLE_Entry> &le_entries, bool metadata) {
+		return Cached_Write(clusters, Data_Clusters(le_entries), metadata);
+	}
+
+	bool CLE_Utils::Read_Data_Clusters(const std::vector<char *> &buffers, const std::vector<TLE_Entry> &le_entries) {
+		return Cached_Read(buffers, Data_Clusters(le_entries));
+	}
+
+	std::vector<uint64_t> CLE_Utils::Cluster_Range(uint64_t first_cluster, uint64_t num_of_clusters) {
+		std::vector<uint64_t> clusters(num_of_clusters);
+		for (uint64_t i = 0; i < num_of_clusters; i++) {
+			clusters[i] = first_cluster + i;
+		}
+
+		return clusters;
+	}
+
+	std::vector<uint64_t> CLE_Utils::Data_Clusters(const std::vector<TLE_Entry> &le_entries) {
+		std::vector<uint64_t> clusters(le_entries.size());
+		for (size_t i = 0; i < le_entries.size(); i++) {
+			clusters[i] = mSb.data_first_cluster + le_entries[i];
+		}
+
+		return clusters;
+	}
+
+	std::vector<char *> CLE_Utils::Contiguous_Buffers(char *buffer, size_t num_of_clusters) {
+		size_t cluster_size = mSb.sectors_per_cluster * mSb.disk_params.bytes_per_sector;
+
+		std::vector<char *> buffers(num_of_clusters);
+		for (size_t i = 0; i < num_of_clusters; i++) {
+			buffers[i] = buffer + i * cluster_size;
+		}
+
+		return buffers;
+	}
+
+	bool CLE_Utils::Cached_Read(const std::vector<char *> &buffers, const std::vector<uint64_t> &clusters) {
+		if (mCache_capacity == 0) {
+			return Vectored_Disk_IO(kiv_hal::NDisk_IO::Read_Sectors_Vectored, buffers, clusters);
+		}
+
+		size_t cluster_size = mSb.sectors_per_cluster * mSb.disk_params.bytes_per_sector;
+
+		// Clusters being read ahead would be read twice otherwise
+		Wait_For_Read_Ahead(clusters);
+
+		// Hits are copied right away, all misses are read by one vectored call
+		std::vector<char *> miss_buffers;
+		std::vector<uint64_t> miss_clusters;
+		{
+			std::unique_lock<std::recursive_mutex> lock(mCache_lock);
+
+			for (size_t i = 0; i < clusters.size(); i++) {
+				TCached_Cluster *cached = Cache_Lookup(clusters[i]);
+				auto journaled = mJournal_pending.find(clusters[i]);
+				if (cached != nullptr) {
+					memcpy(buffers[i], cached->data.data(), cluster_size);
+					mCache_statistics.hits++;
+					continue;
+				}
+				// Committed to the journal but not checkpointed yet, the copy on the disk is older
+				if (journaled != mJournal_pending.end()) {
+					memcpy(buffers[i], journaled->second.data(), cluster_size);
+					mCache_statistics.hits++;
+					continue;
+				}
+
+				// Read ahead, it moves to the cache now that it is used
+				bool read_ahead = false;
+				{
+					std::unique_lock<std::mutex> readahead_lock(mReadahead_lock);
+
+					auto ready = mReadahead_ready.find(clusters[i]);
+					if (ready != mReadahead_ready.end()) {
+						memcpy(buffers[i], ready->second.data(), cluster_size);
+						mReadahead_ready.erase(ready);
+						read_ahead = true;
+					}
+				}
+
+				if (read_ahead) {
+					if (!Cache_Insert(clusters[i], buffers[i], false)) {
+						return false;
+					}
+					mCache_statistics.hits++;
+					mCache_statistics.read_ahead_hits++;
+				}
+				else {
+					miss_buffers.push_back(buffers[i]);
+					miss_clusters.push_back(clusters[i]);
+					mCache_statistics.misses++;
+				}
+			}
+		}
+
+		// The cache stays available to other threads while the misses are read. A cluster missing
+		// from the cache is current on the disk, its writers are excluded by the file or directory lock.
+		if (!Vectored_Disk_IO(kiv_hal::NDisk_IO::Read_Sectors_Vectored, miss_buffers, miss_clusters)) {
+			return false;
+		}
+
+		{
+			std::unique_lock<std::recursive_mutex> lock(mCache_lock);
+			for (size_t i = 0; i < miss_clusters.size(); i++) {
+				if (!Cache_Insert(miss_clusters[i], miss_buffers[i], false)) {
+					return false;
+				}
+			}
+		}
+
+		return Cache_Shrink();
+	}
+
+	bool CLE_Utils::Cached_Write(const std::vector<char *> &buffers, const std::vector<uint64_t> &clusters, bool metadata) {
+		if (mCache_capacity == 0) {
+			return Vectored_Disk_IO(kiv_hal::NDisk_IO::Write_Sectors_Vectored, buffers, clusters);
+		}
+
+		// Written back later, when the cache grows over its capacity or by sync
+		{
+			std::unique_lock<std::recursive_mutex> lock(mCache_lock);
+			for (size_t i = 0; i < clusters.size(); i++) {
+				if (!Cache_Insert(clusters[i], buffers[i], true, metadata)) {
+					return false;
+				}
+			}
+		}
+
+		return Cache_Shrink();
+	}
+
+	CLE_Utils::TCached_Cluster *CLE_Utils::Cache_Lookup(uint64_t cluster) {
+		auto it = mCache.find(cluster);
+		if (it == mCache.end()) {
+			return nullptr;
+		}
+
+		// Move to the front of the LRU list
+		mCache_lru.splice(mCache_lru.begin(), mCache_lru, it->second.lru_position);
+		return &it->second;
+	}
+
+	bool CLE_Utils::Cache_Insert(uint64_t cluster, const char *data, bool dirty, bool metadata) {
+		size_t cluster_size = mSb.sectors_per_cluster * mSb.disk_params.bytes_per_sector;
+
+		TCached_Cluster *cached = Cache_Lookup(cluster);
+		if (cached == nullptr) {
+			// Without a clean cluster to evict the cache grows for a while, Cache_Shrink brings it back without the lock
+			while (mCache.size() >= mCache_capacity && Cache_Evict()) {
+			}
+
+			mCache_lru.push_front(cluster);
+			cached = &mCache[cluster];
+			cached->data.resize(cluster_size);
+			cached->dirty = false;
+			cached->metadata = false;
+			cached->lru_position = mCache_lru.begin();
+		}
+		// Another thread cached the cluster while it was being read, its copy is at least as new
+		else if (!dirty) {
+			return true;
+		}
+
+		if (dirty) {
+			Cancel_Read_Ahead(cluster);
+		}
+
+		memcpy(cached->data.data(), data, cluster_size);
+		cached->dirty = cached->dirty || dirty;
+		if (dirty) {
+			cached->metadata = metadata;
+		}
+
+		return true;
+	}
+
+	bool CLE_Utils::Cache_Evict() {
+		// Least recently used cluster which can go without a write, clusters still being written stay
+		for (auto it = mCache_lru.rbegin(); it != mCache_lru.rend(); ++it) {
+			auto victim = mCache.find(*it);
+			if (!victim->second.dirty && mCache_writing.find(*it) == mCache_writing.end()) {
+				mCache_lru.erase(victim->second.lru_position);
+				mCache.erase(victim);
+				mCache_statistics.evicted++;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	bool CLE_Utils::Cache_Shrink() {
+		{
+			std::unique_lock<std::recursive_mutex> lock(mCache_lock);
+			if (mCache.size() <= mCache_capacity) {
+				return true;
+			}
+		}
+
+		// All dirty clusters are written in one batch instead of one write per eviction.
+		// Journaled metadata is not committed here, an operation may be in the middle of changing it.
+		// It stays cached over the capacity until the next commit.
+		if (!Write_Back_Cache(0, static_cast<uint64_t>(-1), !mJournal_enabled)) {
+			return false;
+		}
+
+		std::unique_lock<std::recursive_mutex> lock(mCache_lock);
+		while (mCache.size() > mCache_capacity && Cache_Evict()) {
+		}
+
+		return true;
+	}
+
+	void CLE_Utils::Cache_Drop(uint64_t first_cluster, uint64_t num_of_clusters) {
+		for (uint64_t cluster = first_cluster; cluster < first_cluster + num_of_clusters; cluster++) {
+			auto it = mCache.find(cluster);
+			if (it != mCache.end()) {
+				mCache_lru.erase(it->second.lru_position);
+				mCache.erase(it);
+			}
+
+			Cancel_Read_Ahead(cluster);
+		}
+	}
+
+	void CLE_Utils::Read_Ahead(const std::vector<TLE_Entry> &le_entries) {
+		if (mCache_capacity == 0) {
+			return;
+		}
+
+		size_t cluster_size = mSb.sectors_per_cluster * mSb.disk_params.bytes_per_sector;
+
+		// Only clusters that a read would have to take from the disk are requested
+		std::vector<uint64_t> clusters;
+		{
+			std::unique_lock<std::recursive_mutex> lock(mCache_lock);
+			std::unique_lock<std::mutex> readahead_lock(mReadahead_lock);
+
+			// Clusters read ahead for readers that went elsewhere are not kept forever
+			if (mReadahead_ready.size() >= mCache_capacity) {
+				mReadahead_ready.clear();
+			}
+
+			size_t limit = (std::max)(mCache_capacity / 4, static_cast<size_t>(1));
+			for (size_t i = 0; i < le_entries.size() && clusters.size() < limit; i++) {
+				uint64_t cluster = mSb.data_first_cluster + le_entries[i];
+
+				if (mCache.find(cluster) == mCache.end()
+					&& mJournal_pending.find(cluster) == mJournal_pending.end()
+					&& mReadahead_in_flight.find(cluster) == mReadahead_in_flight.end()
+					&& mReadahead_ready.find(cluster) == mReadahead_ready.end()) {
+					clusters.push_back(cluster);
+					mReadahead_in_flight.insert(cluster);
+				}
+			}
+
+			mCache_statistics.read_ahead += clusters.size();
+		}
+
+		// Neighbouring clusters are read by one request
+		for (size_t first = 0; first < clusters.size(); ) {
+			size_t count = 1;
+			while (first + count < clusters.size() && clusters[first + count] == clusters[first] + count) {
+				count++;
+			}
+
+			uint64_t first_cluster = clusters[first];
+			auto buffer = std::make_shared<std::vector<char>>(count * cluster_size);
+			auto on_completion = [this, buffer, first_cluster, count](bool success) {
+				Read_Ahead_Completed(first_cluster, count, buffer->data(), success);
+			};
+
+			if (!Submit_To_Disk(kiv_hal::NDisk_IO::Read_Sectors, buffer->data(), first_cluster * mSb.sectors_per_cluster, count * mSb.sectors_per_cluster, on_completion)) {
+				Read_Ahead_Completed(first_cluster, count, nullptr, false);
+			}
+
+			first += count;
+		}
+	}
+
+	void CLE_Utils::Read_Ahead_Completed(uint64_t first_cluster, uint64_t num_of_clusters, const char *data, bool success) {
+		size_t cluster_size = mSb.sectors_per_cluster * mSb.disk_params.bytes_per_sector;
+
+		std::unique_lock<std::mutex> lock(mReadahead_lock);
+
+		// Cancelled clusters were written or freed while being read, what was read is old
+		for (uint64_t i = 0; i < num_of_clusters; i++) {
+			if (mReadahead_in_flight.erase(first_cluster + i) > 0 && success) {
+				mReadahead_ready[first_cluster + i].assign(data + i * cluster_size, data + (i + 1) * cluster_size);
+			}
+		}
+	}
+
+	void CLE_Utils::Wait_For_Read_Ahead(const std::vector<uint64_t> &clusters) {
+		std::vector<uint64_t> in_flight;
+		{
+			std::unique_lock<std::mutex> lock(mReadahead_lock);
+
+			if (mReadahead_in_flight.empty()) {
+				return;
+			}
+
+			for (auto cluster : clusters) {
+				if (mReadahead_in_flight.find(cluster) != mReadahead_in_flight.end()) {
+					in_flight.push_back(cluster);
+				}
+			}
+		}
+
+		for (auto cluster : in_flight) {
+			Wait_For_Async(cluster * mSb.sectors_per_cluster, mSb.sectors_per_cluster);
+		}
+	}
+
+	void CLE_Utils::Cancel_Read_Ahead(uint64_t cluster) {
+		std::unique_lock<std::mutex> lock(mReadahead_lock);
+
+		mReadahead_in_flight.erase(cluster);
+		mReadahead_ready.erase(cluster);
+	}
+
+	bool CLE_Utils::Write_Back_Cache(uint64_t first_cluster, uint64_t num_of_clusters, bool metadata) {
+		std::unique_lock<std::recursive_mutex> write_back_lock(mWrite_back_lock);
+
+		// Clusters are copied, the cache stays available to other threads during the write
+		TCache_Copies copies;
+		{
+			std::unique_lock<std::recursive_mutex> lock(mCache_lock);
+			Take_Dirty_Clusters(copies, first_cluster, num_of_clusters, true, metadata);
+		}
+
+		return Write_Dirty_Clusters(copies);
+	}
+
+	bool CLE_Utils::Write_Dirty_Clusters(TCache_Copies &copies) {
+		if (copies.clusters.empty()) {
+			return true;
+		}
+
+		// Replay would put the older journaled copies over them
+		bool written = Checkpoint_Journal_If_Pending(copies.clusters)
+			&& Vectored_Disk_IO(kiv_hal::NDisk_IO::Write_Sectors_Vectored, Contiguous_Buffers(copies.data.data(), copies.clusters.size()), copies.clusters);
+
+		std::unique_lock<std::recursive_mutex> lock(mCache_lock);
+		Release_Dirty_Clusters(copies, written);
+		if (written) {
+			mCache_statistics.written_back += copies.clusters.size();
+		}
+
+		return written;
+	}
+
+	void CLE_Utils::Take_Dirty_Clusters(TCache_Copies &copies, uint64_t first_cluster, uint64_t num_of_clusters, bool data, bool metadata) {
+		size_t cluster_size = mSb.sectors_per_cluster * mSb.disk_params.bytes_per_sector;
+
+		copies.clusters.clear();
+		for (auto &cached : mCache) {
+			if (cached.second.dirty && (cached.second.metadata ? metadata : data)
+				&& cached.first >= first_cluster && cached.first - first_cluster < num_of_clusters) {
+				copies.clusters.push_back(cached.first);
+			}
+		}
+
+		// Copies in disk order, neighbouring clusters end up in one segment of the write
+		std::sort(copies.clusters.begin(), copies.clusters.end());
+
+		copies.data.resize(copies.clusters.size() * cluster_size);
+		for (size_t i = 0; i < copies.clusters.size(); i++) {
+			TCached_Cluster &cached = mCache.at(copies.clusters[i]);
+			memcpy(copies.data.data() + i * cluster_size, cached.data.data(), cluster_size);
+
+			// Writing the cluster again makes it dirty again, the copy being written is older then
+			cached.dirty = false;
+			mCache_writing.insert(copies.clusters[i]);
+		}
+	}
+
+	void CLE_Utils::Release_Dirty_Clusters(const TCache_Copies &copies, bool written) {
+		for (auto cluster : copies.clusters) {
+			mCache_writing.erase(cluster);
+
+			// Clusters that did not reach the disk are written by the next write-back
+			auto cached = mCache.find(cluster);
+			if (!written && cached != mCache.end()) {
+				cached->second.dirty = true;
+			}
+		}
+	}
+
+	TCluster_Cache_Statistics CLE_Utils::Get_Cache_Statistics() {
+		std::unique_lock<std::recursive_mutex> lock(mCache_lock);
+
+		TCluster_Cache_Statistics statistics = mCache_statistics;
+		statistics.capacity = mCache_capacity;
+		statistics.cached = mCache.size();
+
+		return statistics;
+	}
+
+	bool CLE_Utils::Dentry_Lookup(TLE_Entry directory, const std::string &name, bool &exists, TLE_Dir_Entry &entry) {
+		std::unique_lock<std::mutex> lock(mDentry_lock);
+
+		auto it = mDentries.find(std::make_pair(directory, name));
+		if (it == mDentries.end()) {
+			mDentry_misses++;
+			return false;
+		}
+
+		mDentry_hits++;
+		exists = it->second.exists;
+		if (exists) {
+			entry = it->second.entry;
+		}
+
+		return true;
+	}
+
+	void CLE_Utils::Dentry_Store(TLE_Entry directory, const std::string &name, bool exists, const TLE_Dir_Entry &entry) {
+		std::unique_lock<std::mutex> lock(mDentry_lock);
+
+		if (mDentries.size() >= DENTRY_CACHE_CAPACITY) {
+			mDentries.clear();
+		}
+
+		mDentries[std::make_pair(directory, name)] = TDentry{ exists, entry };
+	}
+
+	void CLE_Utils::Dentry_Invalidate_Directory(TLE_Entry directory) {
+		std::unique_lock<std::mutex> lock(mDentry_lock);
+
+		auto first = mDentries.lower_bound(std::make_pair(directory, std::string()));
+		auto last = first;
+		while (last != mDentries.end() && last->first.first == directory) {
+			++last;
+		}
+
+		mDentries.erase(first, last);
+	}
+
+	std::string CLE_Utils::Get_Dentry_Statistics() {
+		std::unique_lock<std::mutex> lock(mDentry_lock);
+
+		return "dentry cache: " + std::to_string(mDentries.size()) + " entries, "
+			+ std::to_string(mDentry_hits) + " hits, " + std::to_string(mDentry_misses) + " misses\n";
+	}
+
+	bool CLE_Utils::Discard_Data_Clusters(std::vector<TLE_Entry> le_entries) {
+		if (le_entries.empty()) {
+			return true;
+		}
+
+		// No write-back of the freed clusters is in progress while they are dropped
+		std::unique_lock<std::recursive_mutex> write_back_lock(mWrite_back_lock);
+
+		// Dirty copies of freed clusters must never be written back
+		bool journaled = false;
+		{
+			std::unique_lock<std::recursive_mutex> lock(mCache_lock);
+
+			for (auto le_entry : le_entries) {
+				Cache_Drop(mSb.data_first_cluster + le_entry, 1);
+				journaled = (mJournal_pending.erase(mSb.data_first_cluster + le_entry) > 0) || journaled;
+			}
+		}
+
+		// The log must not restore a freed directory cluster over data of its next owner
+		if (journaled && !Checkpoint_Journal()) {
+			return false;
+		}
+
+		// Metadata on the disk still points to the clusters until the freeing is committed, a crash must not find them zeroed
+		std::unique_lock<std::recursive_mutex> allocator_lock(mAllocator_lock);
+		mDiscard_pending.insert(mDiscard_pending.end(), le_entries.begin(), le_entries.end());
+
+		return true;
+	}
+
+	void CLE_Utils::Discard_Committed_Clusters(std::vector<TLE_Entry> &le_entries, bool committed) {
+		if (le_entries.empty()) {
+			return;
+		}
+
+		// Freeing did not reach the disk, the clusters wait for the next commit
+		if (!committed) {
+			std::unique_lock<std::recursive_mutex> allocator_lock(mAllocator_lock);
+			mDiscard_pending.insert(mDiscard_pending.end(), le_entries.begin(), le_entries.end());
+			return;
+		}
+
+		// Commit record has to be on the disk before the clusters it freed are gone
+		if (mJournal_enabled && !Flush_Device()) {
+			return;
+		}
+
+		std::sort(le_entries.begin(), le_entries.end());
+		le_entries.erase(std::unique(le_entries.begin(), le_entries.end()), le_entries.end());
+
+		// Pending requests to the freed clusters must not land after the discard
+		for (auto le_entry : le_entries) {
+			Wait_For_Async((mSb.data_first_cluster + le_entry) * mSb.sectors_per_cluster, mSb.sectors_per_cluster);
+		}
+
+		// Clusters allocated again since their freeing belong to a new owner, allocation waits until the discard is done
+		std::unique_lock<std::recursive_mutex> allocator_lock(mAllocator_lock);
+
+		// Neighbouring clusters are merged into one segment
+		std::vector<kiv_hal::TDisk_Address_Packet> segments;
+		for (auto le_entry : le_entries) {
+			if (mLe_table[le_entry] != ENTRY_FREE) {
+				continue;
+			}
+
+			uint64_t lba_index = (mSb.data_first_cluster + le_entry) * mSb.sectors_per_cluster;
+			if (!segments.empty() && (segments.back().lba_index + segments.back().count == lba_index)) {
+				segments.back().count += mSb.sectors_per_cluster;
+			}
+			else {
+				kiv_hal::TDisk_Address_Packet segment;
+				segment.lba_index = lba_index;
+				segment.count = mSb.sectors_per_cluster;
+				segment.sectors = nullptr;
+				segments.push_back(segment);
+			}
+		}
+
+		if (segments.empty()) {
+			return;
+		}
+
+		kiv_hal::TRegisters regs;
+
+		regs.rax.h = static_cast<decltype(regs.rax.h)>(kiv_hal::NDisk_IO::Discard_Sectors);
+		regs.rdx.l = static_cast<decltype(regs.rdx.l)>(mDisk_number);
+		regs.rdi.r = reinterpret_cast<decltype(regs.rdi.r)>(segments.data());
+		regs.rcx.r = static_cast<decltype(regs.rcx.r)>(segments.size());
+
+		// Discard is only a hint, a failed one is not repeated
+		kiv_hal::Call_Interrupt_Handler(kiv_hal::NInterrupt::Disk_IO, regs);
+	}
+
+	bool CLE_Utils::Vectored_Disk_IO(kiv_hal::NDisk_IO operation, const std::vector<char *> &buffers, const std::vector<uint64_t> &clusters) {
+		if (clusters.empty()) {
+			return true;
+		}
+
+		// i-th cluster is stored in i-th buffer. Clusters adjacent both on the disk and in memory form one segment.
+		std::vector<kiv_hal::TDisk_Address_Packet> segments;
+		for (size_t i = 0; i < clusters.size(); i++) {
+			uint64_t lba_index = clusters[i] * mSb.sectors_per_cluster;
+
+			if (!segments.empty()
+				&& (segments.back().lba_index + segments.back().count == lba_index)
+				&& (static_cast<char *>(segments.back().sectors) + segments.back().count * mSb.disk_params.bytes_per_sector == buffers[i])) {
+				segments.back().count += mSb.sectors_per_cluster;
+			}
+			else {
+				kiv_hal::TDisk_Address_Packet segment;
+				segment.lba_index = lba_index;
+				segment.count = mSb.sectors_per_cluster;
+				segment.sectors = buffers[i];
+				segments.push_back(segment);
+			}
+		}
+
+		for (auto &segment : segments) {
+			Wait_For_Async(segment.lba_index, segment.count);
+		}
+
+		kiv_hal::TRegisters regs;
+
+		regs.rax.h = static_cast<decltype(regs.rax.h)>(operation);
+		regs.rdx.l = static_cast<decltype(regs.rdx.l)>(mDisk_number);
+		regs.rdi.r = reinterpret_cast<decltype(regs.rdi.r)>(segments.data());
+		regs.rcx.r = static_cast<decltype(regs.rcx.r)>(segments.size());
+
+		kiv_hal::Call_Interrupt_Handler(kiv_hal::NInterrupt::Disk_IO, regs);
+
+		return (regs.flags.carry == 0);
+	}
+
+	bool CLE_Utils::Submit_To_Disk(kiv_hal::NDisk_IO operation, char *buffer, uint64_t first_sector, uint64_t num_of_sectors, TAsync_Completion on_completion) {
+		// Requests to the same sectors must not overtake each other
+		Wait_For_Async(first_sector, num_of_sectors);
+
+		TAsync_Request *async_request = new TAsync_Request{};
+		async_request->request.dap.lba_index = first_sector;
+		async_request->request.dap.count = num_of_sectors;
+		async_request->request.dap.sectors = buffer;
+		async_request->request.operation = operation;
+		async_request->request.tag = reinterpret_cast<uint64_t>(async_request);
+		async_request->on_completion = on_completion;
+
+		kiv_hal::TRegisters regs;
+
+		regs.rax.h = static_cast<decltype(regs.rax.h)>(kiv_hal::NDisk_IO::Submit_Requests);
+		regs.rdx.l = static_cast<decltype(regs.rdx.l)>(mDisk_number);
+		regs.rdi.r = reinterpret_cast<decltype(regs.rdi.r)>(&async_request->request);
+		regs.rcx.r = 1;
+
+		// Request has to be in the list before anybody can reap it
+		std::unique_lock<std::mutex> lock(mAsync_lock);
+		kiv_hal::Call_Interrupt_Handler(kiv_hal::NInterrupt::Disk_IO, regs);
+
+		if (regs.flags.carry != 0) {
+			delete async_request;
+			return false;
+		}
+
+		mAsync_in_flight.push_back(async_request);
+		return true;
+	}
+
+	size_t CLE_Utils::Reap_Async(bool wait) {
+		// One reaper at a time, so a request reaped by one thread cannot be seen as in flight after the other one gave up waiting
+		std::unique_lock<std::mutex> reap_lock(mReap_lock);
+
+		{
+			std::unique_lock<std::mutex> lock(mAsync_lock);
+			if (mAsync_in_flight.empty()) {
+				return 0;
+			}
+		}
+
+		const size_t max_completions = 16;
+		kiv_hal::TDisk_Request *completed[max_completions];
+
+		kiv_hal::TRegisters regs;
+
+		regs.rax.h = static_cast<decltype(regs.rax.h)>(kiv_hal::NDisk_IO::Reap_Completions);
+		regs.rdx.l = static_cast<decltype(regs.rdx.l)>(mDisk_number);
+		regs.rdi.r = reinterpret_cast<decltype(regs.rdi.r)>(completed);
+		regs.rcx.r = max_completions;
+		regs.rbx.l = wait ? 1 : 0;
+
+		kiv_hal::Call_Interrupt_Handler(kiv_hal::NInterrupt::Disk_IO, regs);
+
+		if (regs.flags.carry != 0) {
+			return 0;
+		}
+
+		std::vector<TAsync_Request *> reaped;
+		{
+			std::unique_lock<std::mutex> lock(mAsync_lock);
+			for (size_t i = 0; i < regs.rax.r; i++) {
+				TAsync_Request *async_request = reinterpret_cast<TAsync_Request *>(completed[i]->tag);
+
+				mAsync_in_flight.erase(std::remove(mAsync_in_flight.begin(), mAsync_in_flight.end(), async_request), mAsync_in_flight.end());
+				reaped.push_back(async_request);
+			}
+		}
+		reap_lock.unlock();
+
+		// Completions may use the cache, no lock of the async queue is held while they run
+		for (auto async_request : reaped) {
+			if (async_request->on_completion) {
+				async_request->on_completion(async_request->request.status == kiv_hal::NDisk_Status::No_Error);
+			}
+			delete async_request;
+		}
+
+		return reaped.size();
+	}
+
+	void CLE_Utils::Wait_For_Async(uint64_t first_sector, uint64_t num_of_sectors) {
+		auto overlaps = [first_sector, num_of_sectors](TAsync_Request *async_request) {
+			const kiv_hal::TDisk_Address_Packet &dap = async_request->request.dap;
+			return (dap.lba_index < first_sector + num_of_sectors) && (first_sector < dap.lba_index + dap.count);
+		};
+		auto pending = [this, &overlaps]() {
+			std::unique_lock<std::mutex> lock(mAsync_lock);
+			return std::any_of(mAsync_in_flight.begin(), mAsync_in_flight.end(), overlaps);
+		};
+
+		while (pending()) {
+			if (Reap_Async(true) == 0) {
+				break;
+			}
+		}
+	}
+
+	void CLE_Utils::Wait_For_All_Async() {
+		auto pending = [this]() {
+			std::unique_lock<std::mutex> lock(mAsync_lock);
+			return !mAsync_in_flight.empty();
+		};
+
+		while (pending()) {
+			if (Reap_Async(true) == 0) {
+				break;
+			}
+		}
+	}
+
+	bool CLE_Utils::Flush_Disk() {
+		bool synced = Sync();
+
+		// Everything is moved to its place, the disk is consistent without a replay
+		synced = Checkpoint_Journal() && synced;
+
+		Wait_For_All_Async();
+		return Flush_Device() && synced;
+	}
+
+	bool CLE_Utils::Flush_Device() {
+		kiv_hal::TRegisters regs;
+
+		regs.rax.h = static_cast<decltype(regs.rax.h)>(kiv_hal::NDisk_IO::Flush);
+		regs.rdx.l = static_cast<decltype(regs.rdx.l)>(mDisk_number);
+
+		kiv_hal::Call_Interrupt_Handler(kiv_hal::NInterrupt::Disk_IO, regs);
+
+		return (regs.flags.carry == 0);
+	}
+
+	// Depth of the metadata operations of the thread, per file system
+	thread_local std::map<CLE_Utils *, size_t> Metadata_Operation_Depth;
+
+	void CLE_Utils::Begin_Metadata_Operation() {
+		// Nested operation is a part of the outer one, locking shared again could wait behind a waiting commit forever
+		if (Metadata_Operation_Depth[this]++ == 0) {
+			mTransaction_lock.lock_shared();
+		}
+	}
+
+	void CLE_Utils::End_Metadata_Operation() {
+		if (--Metadata_Operation_Depth[this] == 0) {
+			Metadata_Operation_Depth.erase(this);
+			mTransaction_lock.unlock_shared();
+		}
+	}
+
+	CMetadata_Operation::CMetadata_Operation(CLE_Utils *utils) : mUtils(utils) {
+		mUtils->Begin_Metadata_Operation();
+	}
+
+	CMetadata_Operation::~CMetadata_Operation() {
+		mUtils->End_Metadata_Operation();
+	}
+
+	bool CLE_Utils::Sync() {
+		std::unique_lock<std::mutex> commit_lock(mCommit_lock);
+
+		// Called by the sync thread and by flushes.
+		// Group commit: a thread arriving while a commit runs cannot rely on it (its changes may have come too late)
+		// and waits for the next one. The next commit is run by one of the waiting threads and covers all of them.
+		// No lock may be held by the caller, the dirty files are flushed and the commit waits for running operations.
+		uint64_t ticket = ++mCommit_requested;
+		while (mCommit_running) {
+			mCommit_condition.wait(commit_lock);
+		}
+		if (mCommit_completed >= ticket) {
+			return mCommit_result;
+		}
+
+		mCommit_running = true;
+		uint64_t covered = mCommit_requested;
+		commit_lock.unlock();
+
+		// Files are kept alive by the copy, the registry itself is not locked while they are flushed
+		std::vector<std::shared_ptr<CFile>> dirty_files;
+		{
+			std::unique_lock<std::mutex> lock(mDirty_files_lock);
+			for (auto &dirty_file : mDirty_files) {
+				auto file = dirty_file.second.lock();
+				if (file) {
+					dirty_files.push_back(file);
+				}
+			}
+		}
+
+		// Pending file sizes go to their directories first, the directory clusters are committed with the rest
+		bool result = true;
+		for (auto &file : dirty_files) {
+			result &= file->Flush_Metadata();
+		}
+		dirty_files.clear();
+
+		result = Commit_Metadata() && result;
+
+		commit_lock.lock();
+		mCommit_running = false;
+		mCommit_completed = covered;
+		mCommit_result = result;
+		mCommit_condition.notify_all();
+
+		return result;
+	}
+
+	bool CLE_Utils::Commit_Metadata() {
+		// Running operations are finished first and new ones wait, the transaction contains only whole operations.
+		// It is copied under the lock and written without it.
+		std::unique_lock<std::shared_timed_mutex> transaction_lock(mTransaction_lock);
+		std::unique_lock<std::recursive_mutex> write_back_lock(mWrite_back_lock);
+
+		TCache_Copies data;
+		TLe_Table_Snapshot snapshot;
+		TCache_Copies metadata;
+		std::vector<TLE_Entry> discards;
+		{
+			std::unique_lock<std::recursive_mutex> lock(mCache_lock);
+			Take_Dirty_Clusters(data, 0, static_cast<uint64_t>(-1), true, !mJournal_enabled);
+			Take_Le_Table_Snapshot(snapshot);
+			if (mJournal_enabled) {
+				Take_Dirty_Clusters(metadata, 0, static_cast<uint64_t>(-1), false, true);
+			}
+
+			std::unique_lock<std::recursive_mutex> allocator_lock(mAllocator_lock);
+			discards.swap(mDiscard_pending);
+		}
+		transaction_lock.unlock();
+
+		// Data first, committed metadata must not point to clusters which were not written yet
+		if (!Write_Dirty_Clusters(data)) {
+			Mark_Le_Table_Dirty(snapshot);
+			Discard_Committed_Clusters(discards, false);
+			std::unique_lock<std::recursive_mutex> lock(mCache_lock);
+			Release_Dirty_Clusters(metadata, false);
+			return false;
+		}
+
+		if (!mJournal_enabled) {
+			bool written = Write_Le_Table_Snapshot(snapshot);
+			Discard_Committed_Clusters(discards, written);
+			return written;
+		}
+
+		// Changed LE table clusters and all dirty directory clusters form the transaction
+		std::vector<uint64_t> clusters = snapshot.clusters;
+		std::vector<char *> copies = Contiguous_Buffers(snapshot.data.data(), snapshot.clusters.size());
+		std::vector<char *> metadata_copies = Contiguous_Buffers(metadata.data.data(), metadata.clusters.size());
+		clusters.insert(clusters.end(), metadata.clusters.begin(), metadata.clusters.end());
+		copies.insert(copies.end(), metadata_copies.begin(), metadata_copies.end());
+
+		bool committed = Write_Journal(clusters, copies);
+		if (!committed) {
+			Mark_Le_Table_Dirty(snapshot);
+		}
+		Discard_Committed_Clusters(discards, committed);
+
+		// Journaled copies are safe, the cached ones can be evicted without another write
+		std::unique_lock<std::recursive_mutex> lock(mCache_lock);
+		Release_Dirty_Clusters(metadata, committed);
+
+		return committed;
+	}
+
+	bool CLE_Utils::Write_Journal(const std::vector<uint64_t> &clusters, const std::vector<char *> &copies) {
+		size_t cluster_size = mSb.sectors_per_cluster * mSb.disk_params.bytes_per_sector;
+
+		// Changes larger than the log are split into several transactions, each of them is atomic
+		size_t per_transaction = (std::min)(Journal_Descriptor_Capacity(), mSb.journal_number_of_clusters - 3);
+
+		for (size_t first = 0; first < clusters.size(); first += per_transaction) {
+			size_t count = (std::min)(per_transaction, clusters.size() - first);
+
+			// Log is full, the committed copies are moved to their places and the log starts over
+			if (mJournal_head + count + 2 > mSb.journal_number_of_clusters && !Checkpoint_Journal()) {
+				return false;
+			}
+
+			std::vector<char> descriptor(cluster_size, 0);
+			TJournal_Descriptor descriptor_header{};
+			memcpy(descriptor_header.magic, JOURNAL_DESCRIPTOR_MAGIC, sizeof(descriptor_header.magic));
+			descriptor_header.count = static_cast<uint32_t>(count);
+			descriptor_header.sequence = mJournal_sequence;
+			memcpy(descriptor.data(), &descriptor_header, sizeof(descriptor_header));
+			memcpy(descriptor.data() + sizeof(descriptor_header), clusters.data() + first, count * sizeof(uint64_t));
+
+			// Descriptor and the copies are one sequential write
+			uint32_t checksum = JOURNAL_CHECKSUM_SEED;
+			std::vector<char *> buffers{ descriptor.data() };
+			std::vector<uint64_t> log_clusters{ mSb.journal_first_cluster + mJournal_head };
+			for (size_t i = 0; i < count; i++) {
+				checksum = Journal_Checksum(checksum, copies[first + i], cluster_size);
+				buffers.push_back(copies[first + i]);
+				log_clusters.push_back(mSb.journal_first_cluster + mJournal_head + 1 + i);
+			}
+
+			if (!Vectored_Disk_IO(kiv_hal::NDisk_IO::Write_Sectors_Vectored, buffers, log_clusters)) {
+				return false;
+			}
+
+			// Commit record must not reach the disk before the copies
+			if (!Flush_Device()) {
+				return false;
+			}
+
+			std::vector<char> commit(cluster_size, 0);
+			TJournal_Commit commit_record{};
+			memcpy(commit_record.magic, JOURNAL_COMMIT_MAGIC, sizeof(commit_record.magic));
+			commit_record.count = static_cast<uint32_t>(count);
+			commit_record.sequence = mJournal_sequence;
+			commit_record.checksum = checksum;
+			memcpy(commit.data(), &commit_record, sizeof(commit_record));
+
+			if (!Vectored_Disk_IO(kiv_hal::NDisk_IO::Write_Sectors_Vectored, std::vector<char *>{ commit.data() }, std::vector<uint64_t>{ mSb.journal_first_cluster + mJournal_head + 1 + count })) {
+				return false;
+			}
+
+			{
+				std::unique_lock<std::recursive_mutex> lock(mCache_lock);
+				for (size_t i = 0; i < count; i++) {
+					mJournal_pending[clusters[first + i]].assign(copies[first + i], copies[first + i] + cluster_size);
+				}
+			}
+
+			mJournal_head += count + 2;
+			mJournal_sequence++;
+			mJournal_transactions++;
+			mJournal_logged += count;
+		}
+
+		return true;
+	}
+
+	size_t CLE_Utils::Read_Journal_Transaction(size_t position, uint64_t sequence, std::map<uint64_t, std::vector<char>> &copies) {
+		size_t cluster_size = mSb.sectors_per_cluster * mSb.disk_params.bytes_per_sector;
+
+		if (position + 2 > mSb.journal_number_of_clusters) {
+			return 0;
+		}
+
+		std::vector<char> descriptor(cluster_size);
+		if (!Read_From_Disk(descriptor.data(), (mSb.journal_first_cluster + position) * mSb.sectors_per_cluster, mSb.sectors_per_cluster)) {
+			return 0;
+		}
+
+		// Anything else than the expected descriptor ends the log
+		TJournal_Descriptor descriptor_header;
+		memcpy(&descriptor_header, descriptor.data(), sizeof(descriptor_header));
+		if (memcmp(descriptor_header.magic, JOURNAL_DESCRIPTOR_MAGIC, sizeof(descriptor_header.magic)) != 0
+			|| descriptor_header.sequence != sequence
+			|| descriptor_header.count > Journal_Descriptor_Capacity()
+			|| position + descriptor_header.count + 2 > mSb.journal_number_of_clusters) {
+			return 0;
+		}
+
+		size_t count = descriptor_header.count;
+		std::vector<char> data((count + 1) * cluster_size);
+		if (!Read_From_Disk(data.data(), (mSb.journal_first_cluster + position + 1) * mSb.sectors_per_cluster, (count + 1) * mSb.sectors_per_cluster)) {
+			return 0;
+		}
+
+		// Transaction without a valid commit record was interrupted, it is not applied
+		TJournal_Commit commit_record;
+		memcpy(&commit_record, data.data() + count * cluster_size, sizeof(commit_record));
+		if (memcmp(commit_record.magic, JOURNAL_COMMIT_MAGIC, sizeof(commit_record.magic)) != 0
+			|| commit_record.sequence != sequence
+			|| commit_record.count != count
+			|| commit_record.checksum != Journal_Checksum(JOURNAL_CHECKSUM_SEED, data.data(), count * cluster_size)) {
+			return 0;
+		}
+
+		std::vector<uint64_t> clusters(count);
+		memcpy(clusters.data(), descriptor.data() + sizeof(descriptor_header), count * sizeof(uint64_t));
+		for (auto cluster : clusters) {
+			if (!Is_Journal_Home(cluster)) {
+				return 0;
+			}
+		}
+
+		// Later copy of a cluster replaces the earlier one
+		for (size_t i = 0; i < count; i++) {
+			copies[clusters[i]].assign(data.data() + i * cluster_size, data.data() + (i + 1) * cluster_size);
+		}
+
+		return count + 2;
+	}
+
+	bool CLE_Utils::Load_Journal() {
+		std::unique_lock<std::recursive_mutex> write_back_lock(mWrite_back_lock);
+
+		// Images formatted without the journal keep writing metadata in place
+		mJournal_enabled = (memcmp(mSb.journal_magic, JOURNAL_MAGIC, sizeof(mSb.journal_magic)) == 0)
+			&& (mSb.journal_number_of_clusters >= MIN_JOURNAL_CLUSTERS);
+		if (!mJournal_enabled) {
+			return true;
+		}
+
+		size_t cluster_size = mSb.sectors_per_cluster * mSb.disk_params.bytes_per_sector;
+		std::vector<char> header_cluster(cluster_size);
+		if (!Read_From_Disk(header_cluster.data(), mSb.journal_first_cluster * mSb.sectors_per_cluster, mSb.sectors_per_cluster)) {
+			return false;
+		}
+
+		TJournal_Header header;
+		memcpy(&header, header_cluster.data(), sizeof(header));
+		if (memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0) {
+			return false;
+		}
+
+		// Committed transactions are replayed in order, the first invalid one ends the log
+		mJournal_sequence = header.sequence;
+		mJournal_head = 1;
+		mJournal_pending.clear();
+
+		size_t used;
+		while ((used = Read_Journal_Transaction(mJournal_head, mJournal_sequence, mJournal_pending)) > 0) {
+			mJournal_head += used;
+			mJournal_sequence++;
+		}
+
+		// Journaled metadata has to stay in the cache until its commit, it must not go around the journal
+		mCache_capacity = (std::max)(mCache_capacity, static_cast<size_t>(1));
+
+		// Replayed copies go to their places and the log starts over
+		return Checkpoint_Journal();
 	}
 
-	bool CLE_Utils::Write_To_Disk(char *sectors, uint64_t first_sector, uint64_t num_of_sectors) {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+	bool CLE_Utils::Checkpoint_Journal() {
+		std::unique_lock<std::recursive_mutex> write_back_lock(mWrite_back_lock);
 
-		kiv_hal::TRegisters regs;
-		kiv_hal::TDisk_Address_Packet dap;
+		if (!mJournal_enabled || mJournal_head == 1) {
+			return true;
+		}
 
-		dap.lba_index = first_sector;
-		dap.count = num_of_sectors;
-		dap.sectors = sectors;
+		// The copies change only under the write-back lock, reads of the cache keep using them during the write
+		std::vector<uint64_t> clusters;
+		std::vector<char *> buffers;
+		{
+			std::unique_lock<std::recursive_mutex> lock(mCache_lock);
+			for (auto &journaled : mJournal_pending) {
+				clusters.push_back(journaled.first);
+				buffers.push_back(journaled.second.data());
+			}
+		}
 
-		regs.rax.h = static_cast<decltype(regs.rax.h)>(kiv_hal::NDisk_IO::Write_Sectors);;
-		regs.rdx.l = static_cast<decltype(regs.rdx.l)>(mDisk_number);
-		regs.rdi.r = reinterpret_cast<decltype(regs.rdi.r)>(&dap);
+		// The log may be reused only after the copies are on their places
+		if (!Vectored_Disk_IO(kiv_hal::NDisk_IO::Write_Sectors_Vectored, buffers, clusters) || !Flush_Device()) {
+			return false;
+		}
 
-		kiv_hal::Call_Interrupt_Handler(kiv_hal::NInterrupt::Disk_IO, regs);
+		{
+			std::unique_lock<std::recursive_mutex> lock(mCache_lock);
+			mJournal_pending.clear();
+		}
+		mJournal_head = 1;
+		mJournal_checkpoints++;
 
-		return (regs.flags.carry == 0);
+		return Write_Journal_Header();
 	}
 
-	bool CLE_Utils::Read_From_Disk(char *buffer, uint64_t first_sector, uint64_t num_of_sectors) {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+	bool CLE_Utils::Checkpoint_Journal_If_Pending(const std::vector<uint64_t> &clusters) {
+		bool pending = false;
+		{
+			std::unique_lock<std::recursive_mutex> lock(mCache_lock);
+			for (auto cluster : clusters) {
+				pending = pending || (mJournal_pending.find(cluster) != mJournal_pending.end());
+			}
+		}
 
-		kiv_hal::TRegisters regs;
-		kiv_hal::TDisk_Address_Packet dap;
+		return !pending || Checkpoint_Journal();
+	}
 
-		dap.lba_index = first_sector;
-		dap.count = num_of_sectors;
-		dap.sectors = buffer;
+	bool CLE_Utils::Write_Journal_Header() {
+		size_t cluster_size = mSb.sectors_per_cluster * mSb.disk_params.bytes_per_sector;
 
-		regs.rax.h = static_cast<decltype(regs.rax.h)>(kiv_hal::NDisk_IO::Read_Sectors);;
-		regs.rdx.l = static_cast<decltype(regs.rdx.l)>(mDisk_number);
-		regs.rdi.r = reinterpret_cast<decltype(regs.rdi.r)>(&dap);
+		// Transactions in the log have lower sequence numbers than the header from now on, none of them is replayed
+		std::vector<char> header_cluster(cluster_size, 0);
+		TJournal_Header header{};
+		memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+		header.sequence = mJournal_sequence;
+		memcpy(header_cluster.data(), &header, sizeof(header));
 
-		kiv_hal::Call_Interrupt_Handler(kiv_hal::NInterrupt::Disk_IO, regs);
+		return Write_To_Disk(header_cluster.data(), mSb.journal_first_cluster * mSb.sectors_per_cluster, mSb.sectors_per_cluster)
+			&& Flush_Device();
+	}
 
-		return (regs.flags.carry == 0);
+	size_t CLE_Utils::Journal_Descriptor_Capacity() {
+		size_t cluster_size = mSb.sectors_per_cluster * mSb.disk_params.bytes_per_sector;
+		return (cluster_size - sizeof(TJournal_Descriptor)) / sizeof(uint64_t);
+	}
+
+	bool CLE_Utils::Is_Journal_Home(uint64_t cluster) {
+		uint64_t disk_clusters = mSb.disk_params.absolute_number_of_sectors / mSb.sectors_per_cluster;
+
+		// Only the LE table, the root and the data are logged
+		return (cluster >= mSb.le_table_first_cluster) && (cluster < disk_clusters)
+			&& !(cluster >= mSb.journal_first_cluster && cluster < mSb.journal_first_cluster + mSb.journal_number_of_clusters);
 	}
 
-	bool CLE_Utils::Write_Clusters(char *clusters, uint64_t first_cluster, uint64_t num_of_clusters) {
-		return Write_To_Disk(clusters, first_cluster * mSb.sectors_per_cluster, num_of_clusters * mSb.sectors_per_cluster);
+	std::string CLE_Utils::Get_Journal_Statistics() {
+		std::unique_lock<std::recursive_mutex> write_back_lock(mWrite_back_lock);
+
+		if (!mJournal_enabled) {
+			return "journal: none\n";
+		}
+
+		return "journal: " + std::to_string(mJournal_head) + "/" + std::to_string(mSb.journal_number_of_clusters) + " clusters used, "
+			+ std::to_string(mJournal_transactions) + " transactions, " + std::to_string(mJournal_logged) + " clusters logged, "
+			+ std::to_string(mJournal_checkpoints) + " checkpoints\n";
 	}
 
-	bool CLE_Utils::Read_Clusters(char *buffer, uint64_t first_cluster, uint64_t num_of_clusters) {
-		return Read_From_Disk(buffer, first_cluster * mSb.sectors_per_cluster, num_of_clusters * mSb.sectors_per_cluster);
+	void CLE_Utils::Register_Dirty_File(const std::shared_ptr<CFile> &file) {
+		std::unique_lock<std::mutex> lock(mDirty_files_lock);
+
+		mDirty_files[file.get()] = file;
 	}
 
-	bool CLE_Utils::Write_Data_Cluster(char *clusters, TLE_Entry le_entry) {
-		return Write_Clusters(clusters, mSb.data_first_cluster + le_entry, 1);
+	void CLE_Utils::Unregister_Dirty_File(CFile *file) {
+		std::unique_lock<std::mutex> lock(mDirty_files_lock);
+
+		mDirty_files.erase(file);
 	}
 
-	bool CLE_Utils::Read_Data_Cluster(char *buffer, TLE_Entry le_entry) {
-		return Read_Clusters(buffer, mSb.data_first_cluster + le_entry, 1);
+	std::shared_ptr<std::recursive_mutex> CLE_Utils::Get_Directory_Lock(TLE_Entry directory) {
+		std::unique_lock<std::mutex> lock(mDirectory_locks_lock);
+
+		auto &directory_lock = mDirectory_locks[directory];
+		if (!directory_lock) {
+			directory_lock = std::make_shared<std::recursive_mutex>();
+		}
+
+		return directory_lock;
 	}
 
-	bool CLE_Utils::Set_Le_Entries_Value(std::vector<TLE_Entry> &entries, TLE_Entry value) {
-		if (!entries.empty()) {
-			std::map<TLE_Entry, TLE_Entry> map;
-			for (auto it = entries.begin(); it != entries.end(); ++it) {
-				map.insert(std::pair<TLE_Entry, TLE_Entry>(*it, value));
-			}
+	std::shared_ptr<TDirectory_Contents> CLE_Utils::Get_Directory_Contents(TLE_Entry directory) {
+		std::unique_lock<std::mutex> lock(mDirectory_locks_lock);
 
-			if (!Write_Le_Entries(map)) {
-				return false;
-			}
+		auto &contents = mDirectory_contents[directory];
+		if (!contents) {
+			contents = std::make_shared<TDirectory_Contents>();
 		}
 
-		return true;
+		return contents;
 	}
 
-	bool CLE_Utils::Get_Free_Le_Entries(std::vector<TLE_Entry> &entries, size_t number_of_entries) {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+	void CLE_Utils::Drop_Directory_Contents(TLE_Entry directory) {
+		std::unique_lock<std::mutex> lock(mDirectory_locks_lock);
 
-		size_t cluster_size = mSb.sectors_per_cluster * mSb.disk_params.bytes_per_sector;
-		size_t entries_per_cluster = cluster_size / sizeof(TLE_Entry);
+		mDirectory_contents.erase(directory);
+	}
+
+	size_t CLE_Utils::Le_Entries_Per_Cluster() {
+		return (mSb.sectors_per_cluster * mSb.disk_params.bytes_per_sector) / sizeof(TLE_Entry);
+	}
 
-		if (cluster_size < sizeof(TLE_Entry)) {
+	bool CLE_Utils::Load_Le_Table() {
+		size_t entries_per_cluster = Le_Entries_Per_Cluster();
+		if (entries_per_cluster == 0) {
 			return false;
 		}
-		
-		char *cluster_buffer = new char[cluster_size];
 
-		size_t curr_cluster = mSb.le_table_first_cluster;
-		TLE_Entry curr_entry = 0;
+		size_t clusters = (mSb.le_table_number_of_entries + entries_per_cluster - 1) / entries_per_cluster;
 
-		TLE_Entry entry;
-		while (curr_entry < mSb.le_table_number_of_entries) {
+		// The table has its own copy in memory, it bypasses the cluster cache
+		std::vector<TLE_Entry> table(clusters * entries_per_cluster, ENTRY_RESERVED);
+		if (!Read_From_Disk(reinterpret_cast<char *>(table.data()), mSb.le_table_first_cluster * mSb.sectors_per_cluster, clusters * mSb.sectors_per_cluster)) {
+			return false;
+		}
 
-			// Read new cluster if needed
-			if (curr_entry % entries_per_cluster == 0) {
-				Read_Clusters(cluster_buffer, curr_cluster, 1);
-				curr_cluster++;
+		std::unique_lock<std::recursive_mutex> lock(mAllocator_lock);
+		mLe_table.swap(table);
+		mLe_table_dirty.clear();
+		Build_Free_Index();
+		return true;
+	}
+
+	void CLE_Utils::Build_Free_Index() {
+		size_t table_size = mSb.le_table_number_of_entries;
+
+		mFree_bitmap.assign((table_size + 63) / 64, 0);
+		mFree_summary.assign((mFree_bitmap.size() + 63) / 64, 0);
+		mFree_count = 0;
+		mNext_fit = 0;
+
+		for (size_t i = 0; i < table_size; i++) {
+			if (mLe_table[i] == ENTRY_FREE) {
+				Set_Free(static_cast<TLE_Entry>(i), true);
 			}
+		}
+	}
 
-			// Load current LE entry
-			memcpy(&entry, cluster_buffer + (curr_entry % entries_per_cluster) * sizeof(TLE_Entry), sizeof(TLE_Entry));
+	void CLE_Utils::Set_Free(TLE_Entry entry, bool free) {
+		size_t word = entry / 64;
+		uint64_t mask = 1ULL << (entry % 64);
+
+		// Nothing changes
+		if (((mFree_bitmap[word] & mask) != 0) == free) {
+			return;
+		}
 
-			// Free entry found
-			if (entry == ENTRY_FREE) {
-				entries.push_back(curr_entry);
+		if (free) {
+			mFree_bitmap[word] |= mask;
+			mFree_summary[word / 64] |= 1ULL << (word % 64);
+			mFree_count++;
+		}
+		else {
+			mFree_bitmap[word] &= ~mask;
+			if (mFree_bitmap[word] == 0) {
+				mFree_summary[word / 64] &= ~(1ULL << (word % 64));
+			}
+			mFree_count--;
+		}
+	}
 
-				// All requested entries found
-				if (entries.size() == number_of_entries) {
-					return Set_Le_Entries_Value(entries, ENTRY_RESERVED);
-				}
+	size_t CLE_Utils::Find_Free(size_t from) {
+		size_t table_size = mSb.le_table_number_of_entries;
+		if (from >= table_size) {
+			return table_size;
+		}
 
+		// Rest of the word containing the starting entry
+		size_t word = from / 64;
+		uint64_t bits = mFree_bitmap[word] & (~0ULL << (from % 64));
+		if (bits != 0) {
+			return word * 64 + Lowest_Set_Bit(bits);
+		}
+
+		// Following words are skipped by the summary, 64 words (4096 entries) at once
+		for (size_t next = word + 1; next < mFree_bitmap.size(); ) {
+			size_t summary_word = next / 64;
+			uint64_t summary_bits = mFree_summary[summary_word] & (~0ULL << (next % 64));
+			if (summary_bits != 0) {
+				size_t free_word = summary_word * 64 + Lowest_Set_Bit(summary_bits);
+				return free_word * 64 + Lowest_Set_Bit(mFree_bitmap[free_word]);
 			}
+			next = (summary_word + 1) * 64;
+		}
+
+		return table_size;
+	}
+
+	size_t CLE_Utils::Free_Run_Length(size_t first, size_t max_length) {
+		size_t table_size = mSb.le_table_number_of_entries;
+		size_t length = 0;
+
+		while (length < max_length && first + length < table_size) {
+			size_t position = first + length;
+			size_t available = 64 - position % 64;
+
+			// Ones above the shifted word stop the run at the end of the word
+			uint64_t taken = ~(mFree_bitmap[position / 64] >> (position % 64));
+			size_t ones = (taken == 0) ? available : Lowest_Set_Bit(taken);
 
-			curr_entry++;
+			length += ones;
+			if (ones < available) {
+				break;
+			}
 		}
 
-		return false;
+		return (std::min)(length, max_length);
 	}
 
-	bool CLE_Utils::Write_Le_Entries(std::map<TLE_Entry, TLE_Entry> &entries) {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+	void CLE_Utils::Take_Le_Table_Snapshot(TLe_Table_Snapshot &snapshot) {
+		std::unique_lock<std::recursive_mutex> lock(mAllocator_lock);
 
 		size_t cluster_size = mSb.sectors_per_cluster * mSb.disk_params.bytes_per_sector;
-		char *cluster_buffer = new char[cluster_size];
-		size_t entries_per_cluster = cluster_size / sizeof(TLE_Entry);
+		const char *table = reinterpret_cast<const char *>(mLe_table.data());
 
-		size_t cluster_loaded = static_cast<size_t>(-1);
-		size_t cluster_needed;
+		// Copies are stored one after another, neighbouring clusters end up in one segment of the write
+		snapshot.data.resize(mLe_table_dirty.size() * cluster_size);
+		snapshot.clusters.clear();
+		for (auto cluster : mLe_table_dirty) {
+			memcpy(snapshot.data.data() + snapshot.clusters.size() * cluster_size, table + cluster * cluster_size, cluster_size);
+			snapshot.clusters.push_back(mSb.le_table_first_cluster + cluster);
+		}
 
-		size_t order, order_in_cluster;
-		TLE_Entry value;
-		for (auto it = entries.begin(); it != entries.end(); it++) {
-			order = it->first;
-			value = it->second;
+		mLe_table_dirty.clear();
+	}
+
+	bool CLE_Utils::Write_Le_Table_Snapshot(TLe_Table_Snapshot &snapshot) {
+		// The table bypasses the cluster cache
+		if (Vectored_Disk_IO(kiv_hal::NDisk_IO::Write_Sectors_Vectored, Contiguous_Buffers(snapshot.data.data(), snapshot.clusters.size()), snapshot.clusters)) {
+			return true;
+		}
 
-			cluster_needed = (order / entries_per_cluster) + mSb.le_table_first_cluster;
+		Mark_Le_Table_Dirty(snapshot);
+		return false;
+	}
 
-			// This LE entry is not located in currently loaded cluster
-			if (cluster_needed != cluster_loaded) {
+	void CLE_Utils::Mark_Le_Table_Dirty(const TLe_Table_Snapshot &snapshot) {
+		std::unique_lock<std::recursive_mutex> lock(mAllocator_lock);
 
-				// Store current cluster
-				if (cluster_loaded != static_cast<size_t>(-1)) {
-					if (!Write_Clusters(cluster_buffer, cluster_loaded, 1)) {
-						delete[] cluster_buffer;
-						return false;
+		// Written again by the next sync, with whatever the table contains then
+		for (auto cluster : snapshot.clusters) {
+			mLe_table_dirty.insert(static_cast<size_t>(cluster - mSb.le_table_first_cluster));
+		}
+	}
+
+	bool CLE_Utils::Set_Le_Entries_Value(std::vector<TLE_Entry> &entries, TLE_Entry value) {
+		if (!entries.empty()) {
+			std::map<TLE_Entry, TLE_Entry> map;
+			for (auto it = entries.begin(); it != entries.end(); ++it) {
+				map.insert(std::pair<TLE_Entry, TLE_Entry>(*it, value));
+			}
+
+			if (!Write_Le_Entries(map)) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	bool CLE_Utils::Get_Free_Le_Entries(std::vector<TLE_Entry> &entries, size_t number_of_entries, TLE_Entry hint) {
+		std::unique_lock<std::recursive_mutex> lock(mAllocator_lock);
+
+		if (number_of_entries == 0) {
+			return true;
+		}
+
+		// Not enough space, no need to search at all
+		if (number_of_entries > mFree_count) {
+			return false;
+		}
+
+		size_t table_size = mSb.le_table_number_of_entries;
+		std::vector<TLE_Entry> found;
+
+		// Taken entries are removed from the index immediately so the next search skips them
+		auto take = [this, &found](size_t first, size_t length) {
+			for (size_t i = first; i < first + length; i++) {
+				found.push_back(static_cast<TLE_Entry>(i));
+				Set_Free(static_cast<TLE_Entry>(i), false);
+			}
+		};
+
+		// Searches free runs in next-fit order, wraps around the end of the table once
+		auto search = [this, table_size, &found, &take, number_of_entries](bool whole_run_only) {
+			size_t start = (mNext_fit < table_size) ? mNext_fit : 0;
+			size_t position = start;
+			bool wrapped = false;
+
+			while (found.size() < number_of_entries) {
+				size_t first = Find_Free(position);
+				if (first >= table_size) {
+					if (wrapped) {
+						break;
 					}
+					wrapped = true;
+					position = 0;
+					continue;
+				}
+				if (wrapped && first >= start) {
+					break;
 				}
 
-				// Load needed cluster
-				if (!Read_Clusters(cluster_buffer, cluster_needed, 1)) {
-					delete[] cluster_buffer;
-					return false;
+				size_t remaining = number_of_entries - found.size();
+				size_t length = Free_Run_Length(first, remaining);
+				if (!whole_run_only || length == remaining) {
+					take(first, length);
+					if (whole_run_only) {
+						break;
+					}
 				}
 
-				cluster_loaded = cluster_needed;
+				position = first + length;
 			}
+		};
 
-			order_in_cluster = order % entries_per_cluster;
+		// Continue right behind the last cluster of the file
+		if (hint != LE_NO_HINT && hint < table_size) {
+			take(hint, Free_Run_Length(hint, number_of_entries));
+		}
 
-			// Store new LE entry into a buffer
-			memcpy(cluster_buffer + order_in_cluster * sizeof(TLE_Entry), &value, sizeof(TLE_Entry));
+		// Prefer one contiguous run for the rest, fragmented disk takes whatever is free
+		if (found.size() < number_of_entries) {
+			search(true);
 		}
+		if (found.size() < number_of_entries) {
+			search(false);
+		}
+
+		mNext_fit = found.back() + 1;
+
+		entries.insert(entries.end(), found.begin(), found.end());
+		return Set_Le_Entries_Value(found, ENTRY_RESERVED);
+	}
+
+	bool CLE_Utils::Write_Le_Entries(std::map<TLE_Entry, TLE_Entry> &entries) {
+		std::unique_lock<std::recursive_mutex> lock(mAllocator_lock);
 
-		// Store current cluster
-		if (cluster_loaded != static_cast<size_t>(-1)) {
-			if (!Write_Clusters(cluster_buffer, cluster_loaded, 1)) {
-				delete[] cluster_buffer;
+		size_t entries_per_cluster = Le_Entries_Per_Cluster();
+
+		// Only the table in memory is changed, clusters are written back by Sync
+		for (auto it = entries.begin(); it != entries.end(); it++) {
+			if (it->first >= mSb.le_table_number_of_entries) {
 				return false;
 			}
+
+			mLe_table[it->first] = it->second;
+			mLe_table_dirty.insert(it->first / entries_per_cluster);
+			Set_Free(it->first, it->second == ENTRY_FREE);
 		}
 
-		delete[] cluster_buffer;
 		return true;
 	}
 
 	bool CLE_Utils::Get_File_Le_Entries(TLE_Entry first_entry, std::vector<TLE_Entry> &entries) {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
-
-		size_t cluster_size = mSb.sectors_per_cluster * mSb.disk_params.bytes_per_sector;
-		size_t entries_per_cluster = cluster_size / sizeof(TLE_Entry);
-
-		char *cluster_buffer = new char[cluster_size];
-
-		size_t cluster_loaded = static_cast<size_t>(-1);
-		size_t cluster_needed;
-
-		size_t order_in_cluster;
+		std::unique_lock<std::recursive_mutex> lock(mAllocator_lock);
 
 		TLE_Entry value = first_entry;
 		while (value != ENTRY_EOF) {
-			entries.push_back(value);
-
-			cluster_needed = (value / entries_per_cluster) + mSb.le_table_first_cluster;
-
-			// LE entry is not located in currently loaded cluster -> Load needed cluster
-			if (cluster_needed != cluster_loaded) {
-				if (!Read_Clusters(cluster_buffer, cluster_needed, 1)) {
-					delete[] cluster_buffer;
-					return false;
-				}
-				cluster_loaded = cluster_needed;
+			// Broken chain (points outside of the table or contains a cycle)
+			if (value >= mSb.le_table_number_of_entries || entries.size() >= mSb.le_table_number_of_entries) {
+				return false;
 			}
 
-			order_in_cluster = value % entries_per_cluster;
-
-			// Load value
-			memcpy(&value, cluster_buffer + order_in_cluster * sizeof(TLE_Entry), sizeof(TLE_Entry));
+			entries.push_back(value);
+			value = mLe_table[value];
 		}
 
-		delete[] cluster_buffer;
-
 		return true;
 	}
 
 	bool CLE_Utils::Free_File_Le_Entries(TLE_Dir_Entry &entry) {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
-
 		std::vector<TLE_Entry> entries;
 
 		if (!Get_File_Le_Entries(entry.start, entries)) {
 			return false;
 		}
 
-		return Set_Le_Entries_Value(entries, ENTRY_FREE);;
+		// Cached copies are dropped while still allocated, a new owner of the clusters could lose its cached data otherwise.
+		// Discard is only a hint, the clusters are freed even if the disk cannot release them.
+		Discard_Data_Clusters(entries);
+		return Set_Le_Entries_Value(entries, ENTRY_FREE);
 	}
 
-	bool CLE_Utils::Load_Directory(std::vector<TLE_Dir_Entry> dirs_from_root, std::shared_ptr<IDirectory> &directory) {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+	bool CLE_Utils::Resize_Chain(std::vector<TLE_Entry> &chain, size_t num_of_clusters) {
+		// Grow, new clusters preferably continue right behind the current last one
+		if (num_of_clusters > chain.size()) {
+			std::vector<TLE_Entry> new_entries;
+			if (!Get_Free_Le_Entries(new_entries, num_of_clusters - chain.size(), chain.empty() ? LE_NO_HINT : chain.back() + 1)) {
+				return false;
+			}
+
+			// Create new vector of entries (current entries + new entries). Current entries will be set to vector this later.
+			std::vector<TLE_Entry> tmp_entries = chain;
+			tmp_entries.insert(tmp_entries.end(), new_entries.begin(), new_entries.end());
 
+			auto entry_map = Create_Le_Entries_Chain(tmp_entries);
+			if (!Write_Le_Entries(entry_map)) {
+				Set_Le_Entries_Value(new_entries, ENTRY_FREE);
+				return false;
+			}
+
+			chain = tmp_entries;
+		}
+
+		// Shrink, the released clusters are freed and the new last cluster ends the chain
+		else if (num_of_clusters < chain.size()) {
+			std::vector<TLE_Entry> released(chain.begin() + num_of_clusters, chain.end());
+			chain.resize(num_of_clusters);
+
+			Discard_Data_Clusters(released);
+			if (!Set_Le_Entries_Value(released, ENTRY_FREE)) {
+				return false;
+			}
+
+			if (!chain.empty()) {
+				std::vector<TLE_Entry> last{ chain.back() };
+				if (!Set_Le_Entries_Value(last, ENTRY_EOF)) {
+					return false;
+				}
+			}
+		}
+
+		return true;
+	}
+
+	bool CLE_Utils::Load_Directory(std::vector<TLE_Dir_Entry> dirs_from_root, std::shared_ptr<IDirectory> &directory) {
 		TLE_Dir_Entry dir_entry = dirs_from_root.back();
 
 		// Dir is root
@@ -259,7 +1629,7 @@ namespace kiv_fs_linked_entries {
 			kiv_vfs::TPath path;
 			path.file = dir_entry.name;
 			dirs_from_root.pop_back();
-			directory = std::make_shared<CDirectory>(path, dir_entry, dirs_from_root, this, mFs_lock);
+			directory = std::make_shared<CDirectory>(path, dir_entry, dirs_from_root, this);
 		}
 
 		return true;
@@ -294,14 +1664,18 @@ namespace kiv_fs_linked_entries {
 
 #pragma region Abstract directory
 
-	IDirectory::IDirectory(CLE_Utils *utils, std::recursive_mutex *fs_lock) 
-		: mUtils(utils), mSize(0)
+	IDirectory::IDirectory(CLE_Utils *utils, TLE_Entry key)
+		: mContents(utils->Get_Directory_Contents(key)), mEntries(mContents->entries), mIndex(mContents->index),
+		mChain(mContents->chain), mSize(mContents->size), mUtils(utils)
 	{
-		mFs_lock = fs_lock;
+	}
+
+	std::recursive_mutex &IDirectory::Get_Lock() {
+		return *mDir_lock;
 	}
 
 	kiv_os::NOS_Error IDirectory::Read(char *buffer, size_t buffer_size, size_t position, size_t &read) {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+		std::unique_lock<std::recursive_mutex> lock(*mDir_lock);
 
 		read = 0;
 
@@ -341,7 +1715,7 @@ namespace kiv_fs_linked_entries {
 	}
 
 	bool IDirectory::Is_Empty() {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+		std::unique_lock<std::recursive_mutex> lock(*mDir_lock);
 
 		if (!Load()) {
 			return false;
@@ -351,17 +1725,12 @@ namespace kiv_fs_linked_entries {
 	}
 
 	std::shared_ptr<kiv_vfs::IFile> IDirectory::Create_File(const kiv_vfs::TPath path, kiv_os::NFile_Attributes attributes) {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+		std::unique_lock<std::recursive_mutex> lock(*mDir_lock);
 
 		if (!Load()) {
 			return nullptr;
 		}
 
-		// Directory is full
-		if (mEntries.size() == MAX_DIR_ENTRIES) {
-			return nullptr;
-		}
-
 		std::vector<TLE_Entry> entry;
 		if (!mUtils->Get_Free_Le_Entries(entry, 1)) {
 			return nullptr;
@@ -376,6 +1745,8 @@ namespace kiv_fs_linked_entries {
 		dir_entry.start = entry[0];
 
 		mEntries.push_back(dir_entry);
+		mIndex[Make_Name(path.file)] = mEntries.size() - 1;
+		Mark_Dirty(mEntries.size() - 1);
 
 		// Write directory entry to disk
 		std::map<TLE_Entry, TLE_Entry> entry_map;
@@ -383,6 +1754,7 @@ namespace kiv_fs_linked_entries {
 
 		if (!mUtils->Write_Le_Entries(entry_map)) {
 			mUtils->Set_Le_Entries_Value(entry, ENTRY_FREE);
+			mContents->loaded = false; // The added entry is dropped by loading the directory again
 			return nullptr;
 		}
 
@@ -393,6 +1765,13 @@ namespace kiv_fs_linked_entries {
 			return nullptr;
 		}
 
+		// Names cached under a directory which used the same first cluster before are stale
+		if (attributes == kiv_os::NFile_Attributes::Directory) {
+			mUtils->Dentry_Invalidate_Directory(dir_entry.start);
+			mUtils->Drop_Directory_Contents(dir_entry.start);
+		}
+		mUtils->Dentry_Store(Dentry_Key(), path.file, true, dir_entry);
+
 		auto result = Make_File(path, dir_entry);
 		if (!result) {
 			mUtils->Set_Le_Entries_Value(entry, ENTRY_FREE);
@@ -402,131 +1781,201 @@ namespace kiv_fs_linked_entries {
 	}
 
 	bool IDirectory::Remove_File(const kiv_vfs::TPath &path) {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+		std::unique_lock<std::recursive_mutex> lock(*mDir_lock);
 
 		if (!Load()) {
 			return false;
 		}
 
-		for (auto it = mEntries.begin(); it != mEntries.end(); ++it) {
-			// File found
-			if (it->name == path.file) {
+		size_t index = Find_Index(path.file);
+		if (index == mEntries.size()) {
+			return false;
+		}
 
-				if (!mUtils->Free_File_Le_Entries(*it)) {
-					return false;
-				}
+		TLE_Dir_Entry removed = mEntries[index];
 
-				// This is the only dir entry -> just remove it
-				if (mEntries.size() == 1) {
-					mEntries.erase(it);
-				}
-				// Replace this entry with last one
-				else {
-					auto last_entry = mEntries.back();
-					*it = last_entry;
-					mEntries.pop_back();
-				}
+		if (!mUtils->Free_File_Le_Entries(removed)) {
+			return false;
+		}
 
-				mSize -= sizeof(TLE_Dir_Entry);
+		// Replace this entry with the last one
+		size_t last = mEntries.size() - 1;
+		mIndex.erase(Make_Name(removed.name));
+		if (index != last) {
+			mEntries[index] = mEntries[last];
+			mIndex[Make_Name(mEntries[index].name)] = index;
+			Mark_Dirty(index);
+		}
+		mEntries.pop_back();
+		Mark_Dirty(last);
 
-				if (!Save()) {
-					return false;
-				}
-				return true;
-			}
+		mSize -= sizeof(TLE_Dir_Entry);
+
+		if (removed.attributes == kiv_os::NFile_Attributes::Directory) {
+			mUtils->Dentry_Invalidate_Directory(removed.start);
+			mUtils->Drop_Directory_Contents(removed.start);
 		}
+		mUtils->Dentry_Store(Dentry_Key(), path.file, false, removed);
 
-		return false;
+		return Save();
 	}
 
 	bool IDirectory::Find(std::string filename, TLE_Dir_Entry &entry) {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+		// Cached lookups (including missing names) do not touch the directory at all
+		bool exists;
+		if (mUtils->Dentry_Lookup(Dentry_Key(), filename, exists, entry)) {
+			return exists;
+		}
+
+		// Result is stored under the lock, a concurrent change of the directory cannot be overwritten by it
+		std::unique_lock<std::recursive_mutex> lock(*mDir_lock);
+
+		if (!Load()) {
+			return false;
+		}
+
+		size_t index = Find_Index(filename);
+		if (index != mEntries.size()) {
+			entry = mEntries[index];
+			mUtils->Dentry_Store(Dentry_Key(), filename, true, entry);
+			return true;
+		}
+
+		mUtils->Dentry_Store(Dentry_Key(), filename, false, TLE_Dir_Entry{});
+		return false;
+	}
+
+	bool IDirectory::Change_Entry_Size(std::string filename, uint32_t filesize) {
+		std::unique_lock<std::recursive_mutex> lock(*mDir_lock);
 
 		if (!Load()) {
 			return false;
 		}
-		for (auto it = mEntries.begin(); it != mEntries.end(); ++it) {
-			if (it->name == filename) {
-				entry = *it;
-				return true;
-			}
-		}
 
-		return false;
+		size_t index = Find_Index(filename);
+		if (index == mEntries.size()) {
+			return false;
+		}
+
+		mEntries[index].filesize = filesize;
+		Mark_Dirty(index);
+		mUtils->Dentry_Store(Dentry_Key(), filename, true, mEntries[index]);
+
+		return Save();
+	}
+
+	bool IDirectory::Get_Entry_Size(std::string filename, uint32_t &filesize) {
+		TLE_Dir_Entry entry;
+		if (!Find(filename, entry)) {
+			return false;
+		}
+
+		filesize = entry.filesize;
+		return true;
 	}
 
-	bool IDirectory::Change_Entry_Size(std::string filename, uint32_t filesize) {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+	size_t IDirectory::Entries_Per_Cluster() {
+		size_t cluster_size = mUtils->Get_Superblock().sectors_per_cluster * mUtils->Get_Superblock().disk_params.bytes_per_sector;
+		return cluster_size / sizeof(TLE_Dir_Entry);
+	}
 
-		if (!Load()) {
-			return false;
+	size_t IDirectory::Find_Index(const std::string &filename) {
+		// Longer name cannot be stored in an entry
+		if (filename.length() > MAX_FILENAME_SIZE) {
+			return mEntries.size();
 		}
 
-		for (auto it = mEntries.begin(); it != mEntries.end(); ++it) {
-			if (it->name == filename) {
-				it->filesize = filesize;
-				if (!Save()) {
-					return false;
-				}
-				return true;
-			}
+		auto it = mIndex.find(Make_Name(filename));
+		return (it == mIndex.end()) ? mEntries.size() : it->second;
+	}
+
+	void IDirectory::Clear_Entries() {
+		mEntries.clear();
+		mIndex.clear();
+		mDirty_clusters.clear();
+	}
+
+	void IDirectory::Rebuild_Index() {
+		mIndex.clear();
+		mIndex.reserve(mEntries.size());
+		for (size_t i = 0; i < mEntries.size(); i++) {
+			mIndex[Make_Name(mEntries[i].name)] = i;
 		}
+	}
 
-		return false;
+	void IDirectory::Mark_Dirty(size_t entry_index) {
+		mDirty_clusters.insert(Entry_Cluster(entry_index));
 	}
 
-	bool IDirectory::Get_Entry_Size(std::string filename, uint32_t &filesize) {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+	std::vector<size_t> IDirectory::Clusters_To_Save(size_t num_of_clusters) {
+		std::vector<size_t> clusters;
 
-		if (!Load()) {
-			return false;
+		// Nothing marked -> save everything
+		if (mDirty_clusters.empty()) {
+			for (size_t i = 0; i < num_of_clusters; i++) {
+				clusters.push_back(i);
+			}
+			return clusters;
 		}
 
-		for (auto it = mEntries.begin(); it != mEntries.end(); ++it) {
-			if (it->name == filename) {
-				filesize = it->filesize;
-				return true;
+		// Clusters released by shrinking are not saved
+		for (auto cluster : mDirty_clusters) {
+			if (cluster < num_of_clusters) {
+				clusters.push_back(cluster);
 			}
 		}
 
-		return false;
+		return clusters;
 	}
 #pragma endregion
 
 #pragma region Subdirectory
-	CDirectory::CDirectory(const kiv_vfs::TPath path, TLE_Dir_Entry &dir_entry, std::vector<TLE_Dir_Entry> dirs_to_parent, CLE_Utils *utils, std::recursive_mutex *fs_lock)
-		: IDirectory(utils, fs_lock), mDir_entry(dir_entry), mDirs_to_parent(dirs_to_parent)
+	CDirectory::CDirectory(const kiv_vfs::TPath path, TLE_Dir_Entry &dir_entry, std::vector<TLE_Dir_Entry> dirs_to_parent, CLE_Utils *utils)
+		: IDirectory(utils, dir_entry.start), mDir_entry(dir_entry), mDirs_to_parent(dirs_to_parent)
 	{
+		// Size is taken from the parent by Load, the one in the entry may be older
 		mPath = path;
 		mAttributes = dir_entry.attributes;
-		mSize = dir_entry.filesize;
+		mDir_lock = mUtils->Get_Directory_Lock(mDir_entry.start);
 	}
 
-	CDirectory::CDirectory(TLE_Dir_Entry &dir_entry, CLE_Utils *utils, std::recursive_mutex *fs_lock)
-		: IDirectory(utils, fs_lock), mDir_entry(dir_entry), mDirs_to_parent(std::vector<TLE_Dir_Entry>{})
+	CDirectory::CDirectory(TLE_Dir_Entry &dir_entry, CLE_Utils *utils)
+		: IDirectory(utils, dir_entry.start), mDir_entry(dir_entry), mDirs_to_parent(std::vector<TLE_Dir_Entry>{})
 	{
 		mAttributes = dir_entry.attributes;
-		mSize = dir_entry.filesize;
+		mDir_lock = mUtils->Get_Directory_Lock(mDir_entry.start);
 	}
 
 	std::shared_ptr<kiv_vfs::IFile> CDirectory::Make_File(kiv_vfs::TPath path, TLE_Dir_Entry entry) {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
-
 		std::vector<TLE_Dir_Entry> dirs_to_this = { mDirs_to_parent };
 		dirs_to_this.push_back(mDir_entry);
 
 		if (entry.attributes == kiv_os::NFile_Attributes::Directory) {
-			return std::make_shared<CDirectory>(path, entry, dirs_to_this, mUtils, mFs_lock);
+			return std::make_shared<CDirectory>(path, entry, dirs_to_this, mUtils);
 		}
 		else {
-			return std::make_shared<CFile>(path, entry, dirs_to_this, mUtils, mFs_lock);
+			return std::make_shared<CFile>(path, entry, dirs_to_this, mUtils);
 		}
 	}
 
+	TLE_Entry CDirectory::Dentry_Key() {
+		return mDir_entry.start;
+	}
+
+	size_t CDirectory::Entry_Cluster(size_t entry_index) {
+		return entry_index / Entries_Per_Cluster();
+	}
+
 	bool CDirectory::Load() {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+		std::unique_lock<std::recursive_mutex> lock(*mDir_lock);
 
-		mEntries.clear();
+		// Contents stay loaded between operations, changes update them in place
+		mDirty_clusters.clear();
+		if (mContents->loaded) {
+			return true;
+		}
+
+		Clear_Entries();
 
 		// Load size
 		std::shared_ptr<IDirectory> parent;
@@ -536,57 +1985,93 @@ namespace kiv_fs_linked_entries {
 		parent->Get_Entry_Size(mPath.file, mSize);
 
 		size_t cluster_size = mUtils->Get_Superblock().sectors_per_cluster * mUtils->Get_Superblock().disk_params.bytes_per_sector;
-		if (cluster_size < sizeof(TLE_Dir_Entry)) {
+		size_t entries_per_cluster = Entries_Per_Cluster();
+		if (entries_per_cluster == 0) {
+			return false;
+		}
+
+		// Entries are spread over the cluster chain of the directory, no entry crosses a cluster boundary
+		mChain.clear();
+		if (!mUtils->Get_File_Le_Entries(mDir_entry.start, mChain)) {
+			return false;
+		}
+
+		size_t number_of_entries = mSize / sizeof(TLE_Dir_Entry);
+		size_t clusters_used = (std::max)(static_cast<size_t>(1), (number_of_entries + entries_per_cluster - 1) / entries_per_cluster);
+		if (mChain.size() < clusters_used) {
 			return false;
 		}
 
 		// Read data from disk
-		char *buffer = new char[cluster_size];
-		if (!mUtils->Read_Data_Cluster(buffer, mDir_entry.start)) {
-			delete[] buffer;
+		std::vector<char> buffer(clusters_used * cluster_size);
+		std::vector<TLE_Entry> used_chain(mChain.begin(), mChain.begin() + clusters_used);
+		if (!mUtils->Read_Data_Clusters(buffer.data(), used_chain)) {
 			return false;
 		}
 
 		// Parse entries
 		TLE_Dir_Entry entry;
-		size_t number_of_entries = mSize / sizeof(TLE_Dir_Entry);
-
 		for (size_t i = 0; i < number_of_entries; i++) {
-			memcpy(&entry, buffer + i * sizeof(TLE_Dir_Entry), sizeof(TLE_Dir_Entry));
+			memcpy(&entry, buffer.data() + Entry_Cluster(i) * cluster_size + (i % entries_per_cluster) * sizeof(TLE_Dir_Entry), sizeof(TLE_Dir_Entry));
 			mEntries.push_back(entry);
 		}
-
-		delete[] buffer;
+		Rebuild_Index();
+		mContents->loaded = true;
 
 		return true;
 	}
 
 	bool CDirectory::Save() {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+		std::unique_lock<std::recursive_mutex> lock(*mDir_lock);
 
 		size_t cluster_size = mUtils->Get_Superblock().sectors_per_cluster * mUtils->Get_Superblock().disk_params.bytes_per_sector;
-		if (cluster_size < sizeof(TLE_Dir_Entry)) {
+		size_t entries_per_cluster = Entries_Per_Cluster();
+		if (entries_per_cluster == 0) {
 			return false;
 		}
 
-		char *buffer = new char[cluster_size];
+		// Directory keeps at least its first cluster, it is referenced from the parent
+		size_t clusters_needed = (std::max)(static_cast<size_t>(1), (mEntries.size() + entries_per_cluster - 1) / entries_per_cluster);
+		if (!mUtils->Resize_Chain(mChain, clusters_needed)) {
+			mContents->loaded = false; // Unsaved change is dropped by loading the directory again
+			return false;
+		}
+
+		// Save entries of the changed clusters
+		std::vector<size_t> clusters = Clusters_To_Save(clusters_needed);
+		std::vector<char> buffer(clusters.size() * cluster_size, 0);
+		std::vector<char *> buffers;
+		std::vector<TLE_Entry> entries;
+
+		for (size_t i = 0; i < clusters.size(); i++) {
+			char *cluster = buffer.data() + i * cluster_size;
+			size_t first = clusters[i] * entries_per_cluster;
+			size_t last = (std::min)(first + entries_per_cluster, mEntries.size());
 
-		// Save entries
-		size_t address = 0;
-		for (auto it = mEntries.begin(); it != mEntries.end(); ++it) {
-			memcpy(buffer + address, &(*it), sizeof(TLE_Dir_Entry));
-			address += sizeof(TLE_Dir_Entry);
+			for (size_t j = first; j < last; j++) {
+				memcpy(cluster + (j - first) * sizeof(TLE_Dir_Entry), &mEntries[j], sizeof(TLE_Dir_Entry));
+			}
+
+			buffers.push_back(cluster);
+			entries.push_back(mChain[clusters[i]]);
 		}
 
-		bool res = mUtils->Write_Data_Cluster(buffer, mDir_entry.start);
-		delete[] buffer;
+		bool res = mUtils->Write_Data_Clusters(buffers, entries, true);
+		mDirty_clusters.clear();
+		if (!res) {
+			mContents->loaded = false;
+		}
 
-		// Save size of directory
+		// Save size of directory, the parent is not changed when only entries of this one were
 		std::shared_ptr<IDirectory> parent;
 		if (!mUtils->Load_Directory(mDirs_to_parent, parent)) {
-			return nullptr;
+			return false;
+		}
+		uint32_t saved_size;
+		uint32_t size = static_cast<uint32_t>(mEntries.size() * sizeof(TLE_Dir_Entry));
+		if (!parent->Get_Entry_Size(mPath.file, saved_size) || saved_size != size) {
+			parent->Change_Entry_Size(mPath.file, size);
 		}
-		parent->Change_Entry_Size(mPath.file, static_cast<uint32_t>(mEntries.size() * sizeof(TLE_Dir_Entry)));
 
 		return res;
 	}
@@ -594,103 +2079,245 @@ namespace kiv_fs_linked_entries {
 #pragma endregion
 
 #pragma region Root
-	CRoot::CRoot(CLE_Utils *utils, std::recursive_mutex *fs_lock)
-		: IDirectory(utils, fs_lock)
+	CRoot::CRoot(CLE_Utils *utils)
+		: IDirectory(utils, ROOT_DENTRY_KEY)
 	{
 		mAttributes = kiv_os::NFile_Attributes::Directory;
+		mDir_lock = mUtils->Get_Directory_Lock(ROOT_DENTRY_KEY);
+	}
+
+	TLE_Entry CRoot::Dentry_Key() {
+		return ROOT_DENTRY_KEY;
+	}
+
+	size_t CRoot::Entry_Cluster(size_t entry_index) {
+		size_t first_cluster_entries = First_Cluster_Entries();
+		if (entry_index < first_cluster_entries) {
+			return 0;
+		}
+
+		return 1 + (entry_index - first_cluster_entries) / Entries_Per_Cluster();
+	}
+
+	size_t CRoot::First_Cluster_Entries() {
+		size_t cluster_size = mUtils->Get_Superblock().sectors_per_cluster * mUtils->Get_Superblock().disk_params.bytes_per_sector;
+
+		// Size of the root is at the beginning of its cluster, first LE entry of the continuation chain at the end
+		return (cluster_size - sizeof(mSize) - sizeof(TLE_Entry)) / sizeof(TLE_Dir_Entry);
 	}
 
 	bool CRoot::Load() {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+		std::unique_lock<std::recursive_mutex> lock(*mDir_lock);
 
-		mEntries.clear();
+		// Contents stay loaded between operations, changes update them in place
+		mDirty_clusters.clear();
+		if (mContents->loaded) {
+			return true;
+		}
+
+		Clear_Entries();
 
 		size_t cluster_size = mUtils->Get_Superblock().sectors_per_cluster * mUtils->Get_Superblock().disk_params.bytes_per_sector;
-		if (cluster_size < sizeof(mSize) || cluster_size < sizeof(TLE_Dir_Entry)) {
+		if (cluster_size < sizeof(mSize) + sizeof(TLE_Entry) + sizeof(TLE_Dir_Entry)) {
 			return false;
 		}
 
-		char *buffer = new char[cluster_size];
-		if (!mUtils->Read_Clusters(buffer, mUtils->Get_Superblock().root_cluster, 1)) {
-			delete[] buffer;
+		std::vector<char> buffer(cluster_size);
+		if (!mUtils->Read_Clusters(buffer.data(), mUtils->Get_Superblock().root_cluster, 1)) {
 			return false;
 		}
 
 		// Parse size of root
-		memcpy(&mSize, buffer, sizeof(mSize));
+		memcpy(&mSize, buffer.data(), sizeof(mSize));
 
-		// Parse content of root
-		TLE_Dir_Entry entry;
 		size_t number_of_entries = mSize / sizeof(TLE_Dir_Entry);
+		size_t first_cluster_entries = First_Cluster_Entries();
+		size_t entries_per_cluster = Entries_Per_Cluster();
+
+		// The continuation chain is valid only when the first cluster is full
+		// (older images do not initialize the end of the root cluster)
+		mChain.clear();
+		std::vector<char> continuation;
+		if (number_of_entries > first_cluster_entries) {
+			TLE_Entry chain_start;
+			memcpy(&chain_start, buffer.data() + cluster_size - sizeof(TLE_Entry), sizeof(TLE_Entry));
+
+			if (!mUtils->Get_File_Le_Entries(chain_start, mChain)) {
+				return false;
+			}
+
+			size_t clusters_used = (number_of_entries - first_cluster_entries + entries_per_cluster - 1) / entries_per_cluster;
+			if (mChain.size() < clusters_used) {
+				return false;
+			}
+
+			continuation.resize(clusters_used * cluster_size);
+			std::vector<TLE_Entry> used_chain(mChain.begin(), mChain.begin() + clusters_used);
+			if (!mUtils->Read_Data_Clusters(continuation.data(), used_chain)) {
+				return false;
+			}
+		}
 
+		// Parse content of root
+		TLE_Dir_Entry entry;
 		for (size_t i = 0; i < number_of_entries; i++) {
-			memcpy(&entry, buffer + sizeof(mSize) + i * sizeof(TLE_Dir_Entry), sizeof(TLE_Dir_Entry));
+			if (i < first_cluster_entries) {
+				memcpy(&entry, buffer.data() + sizeof(mSize) + i * sizeof(TLE_Dir_Entry), sizeof(TLE_Dir_Entry));
+			}
+			else {
+				size_t index = i - first_cluster_entries;
+				memcpy(&entry, continuation.data() + (index / entries_per_cluster) * cluster_size + (index % entries_per_cluster) * sizeof(TLE_Dir_Entry), sizeof(TLE_Dir_Entry));
+			}
 			mEntries.push_back(entry);
 		}
+		Rebuild_Index();
+		mContents->loaded = true;
 
-		delete[] buffer;
 		return true;
 	}
 
 	bool CRoot::Save() {
+		std::unique_lock<std::recursive_mutex> lock(*mDir_lock);
+
 		size_t cluster_size = mUtils->Get_Superblock().sectors_per_cluster * mUtils->Get_Superblock().disk_params.bytes_per_sector;
-		if (cluster_size < sizeof(mSize) || cluster_size < sizeof(TLE_Dir_Entry)) {
+		if (cluster_size < sizeof(mSize) + sizeof(TLE_Entry) + sizeof(TLE_Dir_Entry)) {
 			return false;
 		}
 
-		char *buffer = new char[cluster_size];
+		size_t first_cluster_entries = First_Cluster_Entries();
+		size_t entries_per_cluster = Entries_Per_Cluster();
 
-		bool result;
+		// Entries which do not fit into the root cluster go to the continuation chain
+		size_t continuation_clusters = (mEntries.size() > first_cluster_entries)
+			? (mEntries.size() - first_cluster_entries + entries_per_cluster - 1) / entries_per_cluster
+			: 0;
+		if (!mUtils->Resize_Chain(mChain, continuation_clusters)) {
+			mContents->loaded = false; // Unsaved change is dropped by loading the root again
+			return false;
+		}
 
-		{
-			std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+		// Root cluster holds the size, so it is saved every time
+		std::vector<size_t> clusters = Clusters_To_Save(continuation_clusters + 1);
+		if (clusters.empty() || clusters.front() != 0) {
+			clusters.insert(clusters.begin(), 0);
+		}
 
-			// Save size of root
-			memcpy(buffer, &mSize, sizeof(mSize));
+		std::vector<char> buffer(clusters.size() * cluster_size, 0);
+		std::vector<char *> buffers;
+		std::vector<TLE_Entry> entries;
+
+		for (size_t i = 0; i < clusters.size(); i++) {
+			char *cluster = buffer.data() + i * cluster_size;
 
-			// Save entries (start after size of the root)
-			size_t address = sizeof(mSize);
-			for (auto it = mEntries.begin(); it != mEntries.end(); ++it) {
-				memcpy(buffer + address, &(*it), sizeof(TLE_Dir_Entry));
-				address += sizeof(TLE_Dir_Entry);
+			if (clusters[i] == 0) {
+				// Save size of root and the start of the continuation chain
+				TLE_Entry chain_start = mChain.empty() ? ENTRY_EOF : mChain.front();
+				memcpy(cluster, &mSize, sizeof(mSize));
+				memcpy(cluster + cluster_size - sizeof(TLE_Entry), &chain_start, sizeof(TLE_Entry));
+
+				// Save entries (start after size of the root)
+				size_t last = (std::min)(first_cluster_entries, mEntries.size());
+				for (size_t j = 0; j < last; j++) {
+					memcpy(cluster + sizeof(mSize) + j * sizeof(TLE_Dir_Entry), &mEntries[j], sizeof(TLE_Dir_Entry));
+				}
 			}
+			else {
+				size_t first = first_cluster_entries + (clusters[i] - 1) * entries_per_cluster;
+				size_t last = (std::min)(first + entries_per_cluster, mEntries.size());
+				for (size_t j = first; j < last; j++) {
+					memcpy(cluster + (j - first) * sizeof(TLE_Dir_Entry), &mEntries[j], sizeof(TLE_Dir_Entry));
+				}
 
-			result = mUtils->Write_Clusters(buffer, mUtils->Get_Superblock().root_cluster, 1);
+				buffers.push_back(cluster);
+				entries.push_back(mChain[clusters[i] - 1]);
+			}
 		}
 
-		delete[] buffer;
+		bool result = mUtils->Write_Clusters(buffer.data(), mUtils->Get_Superblock().root_cluster, 1, true)
+			&& mUtils->Write_Data_Clusters(buffers, entries, true);
+		mDirty_clusters.clear();
+		if (!result) {
+			mContents->loaded = false;
+		}
 
 		return result;
 	}
 
 	std::shared_ptr<kiv_vfs::IFile> CRoot::Make_File(kiv_vfs::TPath path, TLE_Dir_Entry entry) {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
-
 		std::vector<TLE_Dir_Entry> dirs_to_this = { root_dir_entry };
 
 		if (entry.attributes == kiv_os::NFile_Attributes::Directory) {
-			return std::make_shared<CDirectory>(path, entry, dirs_to_this, mUtils, mFs_lock);
+			return std::make_shared<CDirectory>(path, entry, dirs_to_this, mUtils);
 		}
 		else {
-			return std::make_shared<CFile>(path, entry, dirs_to_this, mUtils, mFs_lock);
+			return std::make_shared<CFile>(path, entry, dirs_to_this, mUtils);
 		}
 	}
 #pragma endregion
 
 #pragma region File
-	CFile::CFile(const kiv_vfs::TPath path, TLE_Dir_Entry &dir_entry, std::vector<TLE_Dir_Entry> dirs_to_parent, CLE_Utils *utils, std::recursive_mutex *fs_lock)
+	CFile::CFile(const kiv_vfs::TPath path, TLE_Dir_Entry &dir_entry, std::vector<TLE_Dir_Entry> dirs_to_parent, CLE_Utils *utils)
 		: mUtils(utils), mDirs_to_parent(dirs_to_parent)
 	{
 		mPath = path;
 		mAttributes = dir_entry.attributes;
 		mSize = dir_entry.filesize;
-		mFs_lock = fs_lock;
 		mUtils->Get_File_Le_Entries(dir_entry.start, mLe_entries);
 	}
 
+	CFile::~CFile() {
+		// Mount flushes all dirty files before it goes away, a clean file must not touch it here.
+		// Nobody else can hold the file any more, the registry keeps only a weak reference.
+		if (mSize_dirty) {
+			Write_Size_To_Parent();
+			mUtils->Unregister_Dirty_File(this);
+		}
+	}
+
+	void CFile::Close(const kiv_vfs::TFD_Attributes attrs) {
+		Flush_Metadata();
+	}
+
+	bool CFile::Flush_Metadata() {
+		std::unique_lock<std::shared_timed_mutex> lock(mData_lock);
+
+		return Write_Size_To_Parent();
+	}
+
+	bool CFile::Write_Size_To_Parent() {
+		if (!mSize_dirty) {
+			return true;
+		}
+
+		CMetadata_Operation operation(mUtils);
+		std::shared_ptr<IDirectory> parent;
+		if (!mUtils->Load_Directory(mDirs_to_parent, parent)) {
+			return false;
+		}
+
+		// File could have been deleted meanwhile and its name reused by another one
+		TLE_Dir_Entry entry;
+		if (parent->Find(mPath.file, entry) && !mLe_entries.empty() && entry.start == mLe_entries.front()) {
+			if (!parent->Change_Entry_Size(mPath.file, mSize)) {
+				return false;
+			}
+		}
+
+		mSize_dirty = false;
+		mUtils->Unregister_Dirty_File(this);
+		return true;
+	}
+
+	void CFile::Mark_Size_Dirty() {
+		if (!mSize_dirty) {
+			mSize_dirty = true;
+			mUtils->Register_Dirty_File(shared_from_this());
+		}
+	}
+
 
 	kiv_os::NOS_Error CFile::Write(const char *buffer, size_t buffer_size, size_t position,size_t &written) {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+		std::unique_lock<std::shared_timed_mutex> lock(mData_lock);
 
 		written = 0;
 
@@ -717,9 +2344,11 @@ namespace kiv_fs_linked_entries {
 		// Need new clusters
 		std::vector<TLE_Entry> new_entries;
 		if (mLe_entries.size() < clusters_needed) {
+			CMetadata_Operation operation(mUtils);
+
 			// Get free entries
 			size_t num_of_new_entries = clusters_needed - mLe_entries.size();
-			if (!mUtils->Get_Free_Le_Entries(new_entries, num_of_new_entries)) {
+			if (!mUtils->Get_Free_Le_Entries(new_entries, num_of_new_entries, mLe_entries.empty() ? LE_NO_HINT : mLe_entries.back() + 1)) {
 				return kiv_os::NOS_Error::Not_Enough_Disk_Space;
 			}
 
@@ -737,54 +2366,68 @@ namespace kiv_fs_linked_entries {
 			mLe_entries = tmp_entries;
 		}
 
-		// Write to clusters
-		char *cluster = new char[cluster_size];
-		size_t bytes_to_write_in_cluster;
-		for (size_t i = first_cluster; i <= last_cluster; i++) {
-			if (!mUtils->Read_Data_Cluster(cluster, mLe_entries.at(i))) {
-				delete[] cluster;
-				return kiv_os::NOS_Error::IO_Error;
+		// Clusters covered as a whole are written straight from the caller's buffer (the HAL does not modify it)
+		TCluster_Buffers clusters;
+		Map_Cluster_Buffers(const_cast<char *>(buffer), position, bytes_to_write, clusters);
+
+		// Partially covered clusters keep the rest of their content. Clusters starting at or past the old end
+		// of the file hold no data, their temporary buffers stay zero-filled and are not read.
+		std::vector<char *> partial_buffers;
+		std::vector<TLE_Entry> partial_entries;
+		std::vector<size_t> partial_starts;
+		auto add_partial = [&](std::vector<char> &partial, size_t cluster_index, TLE_Entry entry) {
+			size_t cluster_start = cluster_index * cluster_size;
+			if (!partial.empty() && cluster_start < mSize) {
+				partial_buffers.push_back(partial.data());
+				partial_entries.push_back(entry);
+				partial_starts.push_back(cluster_start);
 			}
+		};
+		add_partial(clusters.first_partial, first_cluster, clusters.entries.front());
+		add_partial(clusters.last_partial, last_cluster, clusters.entries.back());
 
-			// The position has to be taken into consideration in the first cluster
-			if (i == first_cluster) {
-				bytes_to_write_in_cluster = (bytes_to_write > (cluster_size * (i + 1) - position))
-					? (cluster_size * (i + 1) - position)
-					: bytes_to_write;
-				memcpy(cluster + (position - cluster_size * i), buffer, bytes_to_write_in_cluster);
-			}
-			else {
-				bytes_to_write_in_cluster = ((bytes_to_write - written) > cluster_size)
-					? cluster_size
-					: (bytes_to_write - written);
-				memcpy(cluster, buffer + written, bytes_to_write_in_cluster);
-			}
+		if (!mUtils->Read_Data_Clusters(partial_buffers, partial_entries)) {
+			return kiv_os::NOS_Error::IO_Error;
+		}
 
-			if (!mUtils->Write_Data_Cluster(cluster, mLe_entries.at(i))) {
-				delete[] cluster;
-				written = 0;
-				return kiv_os::NOS_Error::IO_Error;
+		// Stale bytes past the old end of the file must not become part of it
+		for (size_t i = 0; i < partial_buffers.size(); i++) {
+			if (partial_starts[i] + cluster_size > mSize) {
+				size_t valid = mSize - partial_starts[i];
+				memset(partial_buffers[i] + valid, 0, cluster_size - valid);
 			}
-			written += bytes_to_write_in_cluster;
 		}
 
-		// Change filesize if needed
+		// Gap between the old end of the file and the written range is zeroed by the same write
+		if (!Map_Zero_Fill(first_cluster, clusters)) {
+			return kiv_os::NOS_Error::IO_Error;
+		}
+
+		size_t first_offset = position - cluster_size * first_cluster;
+		if (!clusters.first_partial.empty()) {
+			memcpy(clusters.first_partial.data() + first_offset, buffer, (std::min)(bytes_to_write, cluster_size - first_offset));
+		}
+		if (!clusters.last_partial.empty()) {
+			size_t last_cluster_start = cluster_size * last_cluster;
+			memcpy(clusters.last_partial.data(), buffer + (last_cluster_start - position), last_byte - last_cluster_start);
+		}
+
+		if (!mUtils->Write_Data_Clusters(clusters.targets, clusters.entries)) {
+			return kiv_os::NOS_Error::IO_Error;
+		}
+		written = bytes_to_write;
+
+		// Change filesize if needed, parent directory gets it on close or sync
 		if (position + bytes_to_write > mSize) {
 			mSize = static_cast<uint32_t>(position + bytes_to_write);
-			std::shared_ptr<IDirectory> parent;
-			if (!mUtils->Load_Directory(mDirs_to_parent, parent)) {
-				written = 0;
-				return kiv_os::NOS_Error::IO_Error;
-			}
-			parent->Change_Entry_Size(mPath.file, mSize);
+			Mark_Size_Dirty();
 		}
 
-		delete[] cluster;
 		return kiv_os::NOS_Error::Success;
 	}
 
 	kiv_os::NOS_Error CFile::Read(char *buffer, size_t buffer_size, size_t position, size_t &read) {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+		std::shared_lock<std::shared_timed_mutex> lock(mData_lock);
 
 		read = 0;
 
@@ -792,6 +2435,11 @@ namespace kiv_fs_linked_entries {
 			return kiv_os::NOS_Error::Invalid_Argument;
 		}
 
+		// Nothing left to read
+		if (position >= mSize) {
+			return kiv_os::NOS_Error::Success;
+		}
+
 		// Get number of bytes to read (whole buffer or rest of the file)
 		size_t bytes_to_read = (position + buffer_size < mSize) 
 			? buffer_size 
@@ -810,39 +2458,129 @@ namespace kiv_fs_linked_entries {
 				: ((last_byte / cluster_size));
 		}
 
-		// Read from clusters
-		char *cluster = new char[cluster_size];
-		size_t bytes_to_read_in_cluster;
-		for (size_t i = first_cluster; i <= last_cluster; i++) {
-			if (!mUtils->Read_Data_Cluster(cluster, mLe_entries.at(i))) {
-				delete[] cluster;
-				read = 0;
-				return kiv_os::NOS_Error::IO_Error;
+		// All clusters of the request are read by one vectored call, whole clusters straight into the caller's buffer
+		TCluster_Buffers clusters;
+		Map_Cluster_Buffers(buffer, position, bytes_to_read, clusters);
+
+		if (!mUtils->Read_Data_Clusters(clusters.targets, clusters.entries)) {
+			return kiv_os::NOS_Error::IO_Error;
+		}
+
+		// The position has to be taken into consideration in the first cluster
+		size_t first_offset = position - cluster_size * first_cluster;
+		if (!clusters.first_partial.empty()) {
+			memcpy(buffer, clusters.first_partial.data() + first_offset, (std::min)(bytes_to_read, cluster_size - first_offset));
+		}
+		if (!clusters.last_partial.empty()) {
+			size_t last_cluster_start = cluster_size * last_cluster;
+			memcpy(buffer + (last_cluster_start - position), clusters.last_partial.data(), last_byte - last_cluster_start);
+		}
+		read = bytes_to_read;
+
+		Read_Ahead(position, read, last_cluster);
+
+		return kiv_os::NOS_Error::Success;
+	}
+
+	void CFile::Read_Ahead(size_t position, size_t read, size_t last_cluster) {
+		std::vector<TLE_Entry> entries;
+		{
+			std::unique_lock<std::mutex> lock(mReadahead_lock);
+
+			// Read continuing where the previous one ended keeps the window, any other starts over
+			bool sequential = (position == mReadahead_next);
+			mReadahead_next = position + read;
+			if (!sequential) {
+				mReadahead_window = 0;
+				mReadahead_end = 0;
+				return;
 			}
 
-			// The position has to be taken into consideration in the first cluster
-			if (i == first_cluster) {
-				bytes_to_read_in_cluster = (bytes_to_read > (cluster_size * (i + 1) - position))
-					? (cluster_size * (i + 1) - position)
-					: bytes_to_read;
-				memcpy(buffer, cluster + (position - (cluster_size * i)), bytes_to_read_in_cluster);
-			} 
+			// Next clusters are requested once the reader gets into the second half of the previous window,
+			// so they arrive while the rest of it is being read
+			size_t first = (std::max)(mReadahead_end, last_cluster + 1);
+			if (mReadahead_window > 0 && first > last_cluster + 1 + mReadahead_window / 2) {
+				return;
+			}
+
+			mReadahead_window = (mReadahead_window == 0)
+				? READAHEAD_MIN_CLUSTERS
+				: (std::min)(mReadahead_window * 2, READAHEAD_MAX_CLUSTERS);
+
+			size_t end = (std::min)(last_cluster + 1 + mReadahead_window, mLe_entries.size());
+			if (first >= end) {
+				return;
+			}
+
+			entries.assign(mLe_entries.begin() + first, mLe_entries.begin() + end);
+			mReadahead_end = end;
+		}
+
+		mUtils->Read_Ahead(entries);
+	}
+
+	void CFile::Map_Cluster_Buffers(char *buffer, size_t position, size_t size, TCluster_Buffers &clusters) {
+		size_t cluster_size = mUtils->Get_Superblock().sectors_per_cluster * mUtils->Get_Superblock().disk_params.bytes_per_sector;
+		size_t first_cluster = position / cluster_size;
+		size_t last_cluster = (position + size - 1) / cluster_size;
+
+		clusters.entries.assign(mLe_entries.begin() + first_cluster, mLe_entries.begin() + last_cluster + 1);
+
+		for (size_t i = first_cluster; i <= last_cluster; i++) {
+			size_t cluster_start = i * cluster_size;
+
+			if (cluster_start >= position && cluster_start + cluster_size <= position + size) {
+				clusters.targets.push_back(buffer + (cluster_start - position));
+			}
+			else if (i == first_cluster) {
+				clusters.first_partial.resize(cluster_size);
+				clusters.targets.push_back(clusters.first_partial.data());
+			}
 			else {
-				bytes_to_read_in_cluster = ((bytes_to_read - read) > cluster_size)
-					? cluster_size
-					: (bytes_to_read - read);
+				clusters.last_partial.resize(cluster_size);
+				clusters.targets.push_back(clusters.last_partial.data());
+			}
+		}
+	}
+
+	bool CFile::Map_Zero_Fill(size_t end_cluster, TCluster_Buffers &clusters) {
+		size_t cluster_size = mUtils->Get_Superblock().sectors_per_cluster * mUtils->Get_Superblock().disk_params.bytes_per_sector;
 
-				memcpy(buffer + read, cluster, bytes_to_read_in_cluster);
+		// Cluster holding the first byte past the end of the file
+		size_t end_of_file_cluster = mSize / cluster_size;
+		if (end_of_file_cluster >= end_cluster) {
+			return true;
+		}
+
+		// Bytes of the last cluster past the end of the file are whatever the disk held before
+		size_t valid = mSize % cluster_size;
+		if (valid != 0) {
+			clusters.old_last.resize(cluster_size);
+			if (!mUtils->Read_Data_Cluster(clusters.old_last.data(), mLe_entries[end_of_file_cluster])) {
+				return false;
 			}
-			read += bytes_to_read_in_cluster;
+			memset(clusters.old_last.data() + valid, 0, cluster_size - valid);
+
+			clusters.entries.push_back(mLe_entries[end_of_file_cluster]);
+			clusters.targets.push_back(clusters.old_last.data());
+			end_of_file_cluster++;
 		}
 
-		delete[] cluster;
-		return kiv_os::NOS_Error::Success;
+		// Clusters past the end, allocated now or before, hold no data yet
+		if (end_of_file_cluster < end_cluster) {
+			clusters.zeros.assign(cluster_size, 0);
+		}
+		for (size_t i = end_of_file_cluster; i < end_cluster; i++) {
+			clusters.entries.push_back(mLe_entries[i]);
+			clusters.targets.push_back(clusters.zeros.data());
+		}
+
+		return true;
 	}
 
 	kiv_os::NOS_Error CFile::Resize(size_t size) {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+		std::unique_lock<std::shared_timed_mutex> lock(mData_lock);
+		CMetadata_Operation operation(mUtils);
 
 		// Nothing to do
 		if (size == mSize) {
@@ -865,10 +2603,11 @@ namespace kiv_fs_linked_entries {
 
 				// Remove last N entries and free them
 				std::vector<TLE_Entry> entries_to_free;
-				for (int i = 0; i < clusters_to_free; i++) {
+				for (size_t i = 0; i < clusters_to_free; i++) {
 					entries_to_free.push_back(mLe_entries.back());
 					mLe_entries.pop_back();
 				}
+				mUtils->Discard_Data_Clusters(entries_to_free);
 				mUtils->Set_Le_Entries_Value(entries_to_free, ENTRY_FREE);
 
 				// Modify last entry
@@ -885,7 +2624,7 @@ namespace kiv_fs_linked_entries {
 				size_t clusters_to_allocate = clusters_needed - clusters_allocated;
 
 				std::vector<TLE_Entry> allocated_entries;
-				if (!mUtils->Get_Free_Le_Entries(allocated_entries, clusters_to_allocate)) {
+				if (!mUtils->Get_Free_Le_Entries(allocated_entries, clusters_to_allocate, mLe_entries.empty() ? LE_NO_HINT : mLe_entries.back() + 1)) {
 					return kiv_os::NOS_Error::Not_Enough_Disk_Space;
 				}
 
@@ -902,39 +2641,41 @@ namespace kiv_fs_linked_entries {
 				mLe_entries = tmp_entries;
 			}
 
+			// Grown part of the file reads as zeros
+			TCluster_Buffers clusters;
+			if (!Map_Zero_Fill(clusters_needed, clusters)
+				|| (!clusters.entries.empty() && !mUtils->Write_Data_Clusters(clusters.targets, clusters.entries))) {
+				return kiv_os::NOS_Error::IO_Error;
+			}
 		}
 
-		// Change filesize
-		mSize = static_cast<uint32_t>(size);
-		std::shared_ptr<IDirectory> parent;
-		if (!mUtils->Load_Directory(mDirs_to_parent, parent)) {
-			return kiv_os::NOS_Error::IO_Error;
+		// Change filesize, parent directory gets it on close or sync
+		if (mSize != size) {
+			mSize = static_cast<uint32_t>(size);
+			Mark_Size_Dirty();
 		}
-		parent->Change_Entry_Size(mPath.file, mSize);
 
 		return kiv_os::NOS_Error::Success;
 	}
 
 	bool CFile::Is_Available_For_Write() {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+		std::shared_lock<std::shared_timed_mutex> lock(mData_lock);
 
 		return (mWrite_count == 0);
 	}
 
 	size_t CFile::Get_Size() {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+		std::shared_lock<std::shared_timed_mutex> lock(mData_lock);
 
 		return mSize;
 	}
 #pragma endregion
 
 #pragma region Mount
-	CMount::CMount(std::string label, kiv_vfs::TDisk_Number disk_number) {
+	CMount::CMount(std::string label, kiv_vfs::TDisk_Number disk_number, size_t cache_capacity) {
 		mLabel = label;
 		mDisk_Number = disk_number;
-		mFs_lock = new std::recursive_mutex();
-
-		mUtils = new CLE_Utils(disk_number, mFs_lock);
+		mUtils = new CLE_Utils(disk_number, cache_capacity);
 
 		kiv_hal::TDrive_Parameters disk_params;
 		if (!Load_Disk_Params(disk_params)) {
@@ -954,21 +2695,57 @@ namespace kiv_fs_linked_entries {
 				return;
 			}
 		}
+		// Formatted with another sector size, every cluster address would be wrong
+		else if (mSuperblock.disk_params.bytes_per_sector != disk_params.bytes_per_sector) {
+			mMounted = false;
+			return;
+		}
 
-		root = std::make_shared<CRoot>(mUtils, mFs_lock);
+		root = std::make_shared<CRoot>(mUtils);
 
 		mUtils->Set_Superblock(mSuperblock);
 		mUtils->Set_Root(root);
+
+		// Replay puts committed metadata (including the LE table) to its place, it has to precede loading the table
+		if (!mUtils->Load_Journal()) {
+			mMounted = false;
+			return;
+		}
+
+		if (!mUtils->Load_Le_Table()) {
+			mMounted = false;
+			return;
+		}
+
+		mSync_thread = std::thread(&CMount::Sync_Loop, this);
 	}
 
 	CMount::~CMount() {
+		if (mSync_thread.joinable()) {
+			{
+				std::unique_lock<std::mutex> lock(mSync_mutex);
+				mSync_stop = true;
+			}
+			mSync_condition.notify_all();
+			mSync_thread.join();
+		}
+
+		mUtils->Flush_Disk();
 		delete mUtils;
-		delete mFs_lock;
 	}
 
-	kiv_os::NOS_Error CMount::Open_File(const kiv_vfs::TPath &path, kiv_os::NFile_Attributes attributes, std::shared_ptr<kiv_vfs::IFile> &file) {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+	std::string CMount::Get_Statistics() {
+		TCluster_Cache_Statistics statistics = mUtils->Get_Cache_Statistics();
+
+		return "cluster cache: " + std::to_string(statistics.cached) + "/" + std::to_string(statistics.capacity) + " clusters, "
+			+ std::to_string(statistics.hits) + " hits, " + std::to_string(statistics.misses) + " misses, "
+			+ std::to_string(statistics.written_back) + " written back, " + std::to_string(statistics.evicted) + " evicted, "
+			+ std::to_string(statistics.read_ahead) + " read ahead (" + std::to_string(statistics.read_ahead_hits) + " used)\n"
+			+ mUtils->Get_Dentry_Statistics()
+			+ mUtils->Get_Journal_Statistics();
+	}
 
+	kiv_os::NOS_Error CMount::Open_File(const kiv_vfs::TPath &path, kiv_os::NFile_Attributes attributes, std::shared_ptr<kiv_vfs::IFile> &file) {
 		std::vector<TLE_Dir_Entry> entries_from_root{ root_dir_entry };
 		TLE_Dir_Entry entry;
 		std::shared_ptr<IDirectory> directory;
@@ -1010,8 +2787,6 @@ namespace kiv_fs_linked_entries {
 	}
 
 	kiv_os::NOS_Error CMount::Create_File(const kiv_vfs::TPath &path, kiv_os::NFile_Attributes attributes, std::shared_ptr<kiv_vfs::IFile> &file) {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
-
 		// Checking filenames
 		if (path.file.length() == 0 || path.file.length() > MAX_FILENAME_SIZE) {
 			return kiv_os::NOS_Error::Invalid_Argument;
@@ -1022,10 +2797,18 @@ namespace kiv_fs_linked_entries {
 			}
 		}
 
+		// Committed later by the sync thread, together with the other operations
+		CMetadata_Operation operation(mUtils);
+		return Create_Entry(path, attributes, file);
+	}
+
+	kiv_os::NOS_Error CMount::Create_Entry(const kiv_vfs::TPath &path, kiv_os::NFile_Attributes attributes, std::shared_ptr<kiv_vfs::IFile> &file) {
 		// Create file directly in the root
 		if (path.path.empty()) {
+			// Lookup, removal of the old file and creation are one change of the directory
+			std::unique_lock<std::recursive_mutex> lock(root->Get_Lock());
 			if (root->Find(path.file, TLE_Dir_Entry{})) {
-				Delete_File(path);
+				Delete_Entry(path);
 			}
 			file = root->Create_File(path, attributes);
 			if (!file) {
@@ -1042,6 +2825,7 @@ namespace kiv_fs_linked_entries {
 		// Find parent
 		for (int i = 0; i < path.path.size(); i++) {
 			mUtils->Load_Directory(entries_from_root, directory);
+			std::unique_lock<std::recursive_mutex> lock(directory->Get_Lock());
 			// Directory not exists -> Create it
 			if (!directory->Find(path.path[i], entry)) {
 				tmp_path.file = path.path[i];
@@ -1057,8 +2841,9 @@ namespace kiv_fs_linked_entries {
 
 		// File already exists -> Remove it
 		mUtils->Load_Directory(entries_from_root, directory);
+		std::unique_lock<std::recursive_mutex> lock(directory->Get_Lock());
 		if (directory->Find(path.file, entry)) {
-			Delete_File(path);
+			Delete_Entry(path);
 		}
 		file = directory->Create_File(path, attributes);
 		if (!file) {
@@ -1068,8 +2853,11 @@ namespace kiv_fs_linked_entries {
 	}
 
 	kiv_os::NOS_Error CMount::Delete_File(const kiv_vfs::TPath &path) {
-		std::unique_lock<std::recursive_mutex> lock(*mFs_lock);
+		CMetadata_Operation operation(mUtils);
+		return Delete_Entry(path);
+	}
 
+	kiv_os::NOS_Error CMount::Delete_Entry(const kiv_vfs::TPath &path) {
 		kiv_vfs::TPath parent_path;
 
 		// Get path of file's parent
@@ -1096,6 +2884,14 @@ namespace kiv_fs_linked_entries {
 			: kiv_os::NOS_Error::File_Not_Found;
 	}
 
+	void CMount::Sync_Loop() {
+		std::unique_lock<std::mutex> lock(mSync_mutex);
+
+		while (!mSync_condition.wait_for(lock, SYNC_INTERVAL, [this]() { return mSync_stop; })) {
+			mUtils->Sync();
+		}
+	}
+
 	bool CMount::Load_Superblock(kiv_hal::TDrive_Parameters &params) {
 		char *buff = new char[params.bytes_per_sector];
 
@@ -1117,7 +2913,14 @@ namespace kiv_fs_linked_entries {
 		size_t sectors_per_cluster = 1;
 		size_t cluster_size = sectors_per_cluster * params.bytes_per_sector;
 		size_t disk_size = params.absolute_number_of_sectors * params.bytes_per_sector;
-		size_t available_space = disk_size - (2 * cluster_size); // Disk size - superblock cluster - root cluster
+
+		// Journal takes a small part of the disk, too small disks go without it
+		size_t journal_clusters = (std::min)(DEFAULT_JOURNAL_CLUSTERS, static_cast<size_t>(params.absolute_number_of_sectors / sectors_per_cluster) / JOURNAL_DISK_FRACTION);
+		if (journal_clusters < MIN_JOURNAL_CLUSTERS) {
+			journal_clusters = 0;
+		}
+
+		size_t available_space = disk_size - ((2 + journal_clusters) * cluster_size); // Disk size - superblock cluster - root cluster - journal
 		size_t num_of_le_entries = available_space / (sizeof(TLE_Dir_Entry) + cluster_size);
 		num_of_le_entries -= ((num_of_le_entries * sizeof(TLE_Entry)) % (cluster_size)) / sizeof(TLE_Entry);
 		size_t num_of_le_entries_clusters = (num_of_le_entries * sizeof(TLE_Entry)) / cluster_size;
@@ -1129,13 +2932,20 @@ namespace kiv_fs_linked_entries {
 		mSuperblock.sectors_per_cluster = sectors_per_cluster;
 		mSuperblock.le_table_number_of_entries = num_of_le_entries;
 		mSuperblock.root_cluster = 1 + num_of_le_entries_clusters;
-		mSuperblock.data_first_cluster = mSuperblock.root_cluster + 1; 
+		mSuperblock.journal_first_cluster = mSuperblock.root_cluster + 1;
+		mSuperblock.journal_number_of_clusters = journal_clusters;
+		memset(mSuperblock.journal_magic, 0, sizeof(mSuperblock.journal_magic));
+		if (journal_clusters > 0) {
+			memcpy(mSuperblock.journal_magic, JOURNAL_MAGIC, sizeof(mSuperblock.journal_magic));
+		}
+		mSuperblock.data_first_cluster = mSuperblock.journal_first_cluster + journal_clusters; 
 
 		mUtils->Set_Superblock(mSuperblock);
 
-		// Write superblock to the first sector
-		char *superblock_sector = reinterpret_cast<char *>(&mSuperblock);
-		if (!mUtils->Write_To_Disk(superblock_sector, 0, 1)) {
+		// Write superblock to the first sector, the rest of the sector is zeroed
+		std::vector<char> superblock_sector(params.bytes_per_sector, 0);
+		memcpy(superblock_sector.data(), &mSuperblock, sizeof(mSuperblock));
+		if (!mUtils->Write_To_Disk(superblock_sector.data(), 0, 1)) {
 			return false;
 		}
 
@@ -1147,6 +2957,10 @@ namespace kiv_fs_linked_entries {
 			return false;
 		}
 
+		if (!Init_Journal()) {
+			return false;
+		}
+
 		return true;
 	}
 
@@ -1196,7 +3010,8 @@ namespace kiv_fs_linked_entries {
 		}
 
 		// Write LE table
-		bool write_result = mUtils->Write_Clusters(buffer, mSuperblock.le_table_first_cluster, clusters_needed);
+		// Written around the cluster cache, the table is loaded from the disk right after formatting
+		bool write_result = mUtils->Write_To_Disk(buffer, mSuperblock.le_table_first_cluster * mSuperblock.sectors_per_cluster, clusters_needed * mSuperblock.sectors_per_cluster);
 
 		delete[] buffer;
 
@@ -1220,15 +3035,32 @@ namespace kiv_fs_linked_entries {
 		return result;
 	}
 
+	bool CMount::Init_Journal() {
+		if (mSuperblock.journal_number_of_clusters == 0) {
+			return true;
+		}
+
+		size_t cluster_size = mSuperblock.sectors_per_cluster * mSuperblock.disk_params.bytes_per_sector;
+
+		// Empty log, the first transaction gets sequence number 1
+		std::vector<char> buffer(cluster_size, 0);
+		TJournal_Header header{};
+		memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+		header.sequence = 1;
+		memcpy(buffer.data(), &header, sizeof(header));
+
+		return mUtils->Write_To_Disk(buffer.data(), mSuperblock.journal_first_cluster * mSuperblock.sectors_per_cluster, mSuperblock.sectors_per_cluster);
+	}
+
 #pragma endregion
 
 #pragma region Filesystem
-	CFile_System::CFile_System() {
+	CFile_System::CFile_System(size_t cache_capacity) : mCache_capacity(cache_capacity) {
 		mName = LE_NAME;
 	}
 
 	kiv_vfs::IMounted_File_System *CFile_System::Create_Mount(const std::string label, const kiv_vfs::TDisk_Number disk_number) {
-		return new CMount(label, disk_number);
+		return new CMount(label, disk_number, mCache_capacity);
 	}
 #pragma endregion
 }
\ No newline at end of file
@@ -1,6 +1,13 @@
 #pragma once
 #include <mutex>
+#include <shared_mutex>
 #include <map>
+#include <set>
+#include <list>
+#include <unordered_map>
+#include <functional>
+#include <thread>
+#include <condition_variable>
 
 #include "vfs.h"
 #include "../api/api.h"
@@ -24,10 +31,37 @@ namespace kiv_fs_linked_entries {
 		size_t le_table_number_of_entries;
 		size_t root_cluster;
 		size_t data_first_cluster;
+		// Metadata journal, placed between the root cluster and the data. Older images end before these fields,
+		// the journal is used only when journal_magic is present.
+		size_t journal_first_cluster;
+		size_t journal_number_of_clusters;
+		char journal_magic[4]; // 'lej\0'
 	};
 
 	using TLE_Entry = uint32_t;
 
+	// Number of clusters kept in the cluster cache of a mount when nothing else is configured
+	const size_t DEFAULT_CLUSTER_CACHE_CAPACITY = 256;
+	// Larger configured capacities are taken as a mistake
+	const size_t MAX_CLUSTER_CACHE_CAPACITY = 1 << 20;
+
+	// Allocation without a preferred place, next-fit from the last allocation is used
+	const TLE_Entry LE_NO_HINT = static_cast<TLE_Entry>(-1);
+
+	// Called when an asynchronous disk request completes
+	using TAsync_Completion = std::function<void(bool success)>;
+
+	struct TCluster_Cache_Statistics {
+		size_t capacity = 0;
+		size_t cached = 0;
+		size_t hits = 0;
+		size_t misses = 0;
+		size_t written_back = 0;
+		size_t evicted = 0;
+		size_t read_ahead = 0; // Clusters requested ahead of sequential readers
+		size_t read_ahead_hits = 0; // Of them, clusters a read actually used
+	};
+
 	struct TLE_Dir_Entry {
 		char name[12]; 
 		char fill[3]; // Fill to 24 bytes
@@ -36,22 +70,92 @@ namespace kiv_fs_linked_entries {
 		uint32_t filesize;
 	};
 
+	// First cluster of the journal region, transactions of the log follow it
+	struct TJournal_Header {
+		char magic[4]; // 'lej\0'
+		uint32_t reserved;
+		uint64_t sequence; // Sequence number of the first transaction in the log
+	};
+
+	// Starts a transaction, followed by the numbers of the clusters the logged copies belong to
+	struct TJournal_Descriptor {
+		char magic[4]; // 'ljd\0'
+		uint32_t count;
+		uint64_t sequence;
+	};
+
+	// Ends a transaction, written only after all its clusters reached the disk
+	struct TJournal_Commit {
+		char magic[4]; // 'ljc\0'
+		uint32_t count;
+		uint64_t sequence;
+		uint32_t checksum; // Over the logged copies
+	};
+
+	// Name of a directory entry as a key of the in-memory directory index, compared without allocations
+	struct TLE_Name {
+		char name[12];
+
+		bool operator==(const TLE_Name &other) const;
+	};
+
+	struct TLE_Name_Hash {
+		size_t operator()(const TLE_Name &name) const;
+	};
+
+	// Loaded directory, shared by all objects of the directory and kept between operations. Guarded by the directory lock.
+	struct TDirectory_Contents {
+		bool loaded = false;
+		std::vector<TLE_Dir_Entry> entries;
+		std::unordered_map<TLE_Name, size_t, TLE_Name_Hash> index; // Name -> position in entries
+		std::vector<TLE_Entry> chain; // Data clusters holding the entries
+		uint32_t size = 0;
+	};
+
 	// Utils for mount and files
 	class CLE_Utils {
 		public:
-			CLE_Utils(TSuperblock &sb, kiv_vfs::TDisk_Number disk_number, std::recursive_mutex *fs_lock);
-			CLE_Utils(kiv_vfs::TDisk_Number disk_number, std::recursive_mutex *fs_lock);
+			CLE_Utils(TSuperblock &sb, kiv_vfs::TDisk_Number disk_number, size_t cache_capacity);
+			CLE_Utils(kiv_vfs::TDisk_Number disk_number, size_t cache_capacity);
 			bool Write_To_Disk(char *sectors, uint64_t first_sector, uint64_t num_of_sectors);
 			bool Read_From_Disk(char *buffer, uint64_t first_sector, uint64_t num_of_sectors);
-			bool Write_Clusters(char *clusters, uint64_t first_cluster, uint64_t num_of_clusters);
+			bool Write_Clusters(char *clusters, uint64_t first_cluster, uint64_t num_of_clusters, bool metadata = false);
 			bool Read_Clusters(char *buffer, uint64_t first_cluster, uint64_t num_of_clusters);
 			bool Write_Data_Cluster(char *clusters, TLE_Entry le_entry);
 			bool Read_Data_Cluster(char *buffer, TLE_Entry le_entry);
+			bool Write_Data_Clusters(char *clusters, const std::vector<TLE_Entry> &le_entries);
+			bool Read_Data_Clusters(char *buffer, const std::vector<TLE_Entry> &le_entries);
+			bool Write_Data_Clusters(const std::vector<char *> &clusters, const std::vector<TLE_Entry> &le_entries, bool metadata = false);
+			bool Read_Data_Clusters(const std::vector<char *> &buffers, const std::vector<TLE_Entry> &le_entries);
+			bool Discard_Data_Clusters(std::vector<TLE_Entry> le_entries);
+			size_t Reap_Async(bool wait);
+			void Wait_For_Async(uint64_t first_sector, uint64_t num_of_sectors);
+			void Wait_For_All_Async();
+			void Read_Ahead(const std::vector<TLE_Entry> &le_entries);
+			bool Flush_Disk();
+			bool Sync();
+			void Begin_Metadata_Operation();
+			void End_Metadata_Operation();
+			bool Write_Back_Cache(uint64_t first_cluster = 0, uint64_t num_of_clusters = static_cast<uint64_t>(-1), bool metadata = true);
+			TCluster_Cache_Statistics Get_Cache_Statistics();
+			bool Dentry_Lookup(TLE_Entry directory, const std::string &name, bool &exists, TLE_Dir_Entry &entry);
+			void Dentry_Store(TLE_Entry directory, const std::string &name, bool exists, const TLE_Dir_Entry &entry);
+			void Dentry_Invalidate_Directory(TLE_Entry directory);
+			std::string Get_Dentry_Statistics();
+			void Register_Dirty_File(const std::shared_ptr<CFile> &file);
+			void Unregister_Dirty_File(CFile *file);
+			std::shared_ptr<std::recursive_mutex> Get_Directory_Lock(TLE_Entry directory);
+			std::shared_ptr<TDirectory_Contents> Get_Directory_Contents(TLE_Entry directory);
+			void Drop_Directory_Contents(TLE_Entry directory);
+			bool Load_Le_Table();
+			bool Load_Journal();
+			std::string Get_Journal_Statistics();
 			bool Set_Le_Entries_Value(std::vector<TLE_Entry> &entries, TLE_Entry value);
-			bool Get_Free_Le_Entries(std::vector<TLE_Entry> &entries, size_t number_of_entries);
+			bool Get_Free_Le_Entries(std::vector<TLE_Entry> &entries, size_t number_of_entries, TLE_Entry hint = LE_NO_HINT);
 			bool Write_Le_Entries(std::map<TLE_Entry, TLE_Entry> &entries);
 			bool Get_File_Le_Entries(TLE_Entry first_entry, std::vector<TLE_Entry> &entries);
 			bool Free_File_Le_Entries(TLE_Dir_Entry &entry);
+			bool Resize_Chain(std::vector<TLE_Entry> &chain, size_t num_of_clusters);
 			bool Load_Directory(std::vector<TLE_Dir_Entry> dirs_from_root, std::shared_ptr<IDirectory> &directory);
 			std::map<TLE_Entry, TLE_Entry> Create_Le_Entries_Chain(std::vector<TLE_Entry> &entries);
 
@@ -61,14 +165,169 @@ namespace kiv_fs_linked_entries {
 		private:
 			TSuperblock mSb;
 			kiv_vfs::TDisk_Number mDisk_number;
-			std::recursive_mutex *mFs_lock;
 			std::shared_ptr<CRoot> mRoot;
+
+			// Lock order: file data (CFile) -> transaction -> directories (child before parent) -> write-back -> cluster cache -> async reaping.
+			// Allocator, async list, dentry, dirty files, directory lock table and readahead are leaves, no other lock is taken under them.
+			// The cache lock is never held across disk I/O. Write-backs, journal commits, checkpoints and discards hold
+			// the write-back lock instead, so an older copy of a cluster cannot reach the disk after a newer one.
+			// Metadata operations share the transaction lock, a commit holds it exclusively while it takes its transaction.
+			std::shared_timed_mutex mTransaction_lock;
+			std::recursive_mutex mAllocator_lock;
+			std::recursive_mutex mWrite_back_lock;
+			std::recursive_mutex mCache_lock;
+			std::mutex mAsync_lock;
+			std::mutex mReap_lock;
+			std::mutex mDentry_lock;
+			std::mutex mDirty_files_lock;
+			std::mutex mDirectory_locks_lock;
+			std::mutex mReadahead_lock;
+
+			// Directory objects are created for every operation, their locks live here, keyed by the first cluster
+			std::map<TLE_Entry, std::shared_ptr<std::recursive_mutex>> mDirectory_locks;
+			// Loaded directories, keyed the same way. Dropped when the directory is freed or created again.
+			std::map<TLE_Entry, std::shared_ptr<TDirectory_Contents>> mDirectory_contents;
+
+			// Whole LE table, loaded at mount. Padded to whole clusters so a cluster can be written straight from it.
+			std::vector<TLE_Entry> mLe_table;
+			// Indexes (relative to the first LE table cluster) of clusters changed since the last sync
+			std::set<size_t> mLe_table_dirty;
+			// Freed clusters discarded on the disk after the commit of their freeing, guarded by the allocator lock
+			std::vector<TLE_Entry> mDiscard_pending;
+
+			// Free space index over mLe_table, bit is set for a free entry.
+			// Summary bit is set when the corresponding bitmap word contains a free entry.
+			std::vector<uint64_t> mFree_bitmap;
+			std::vector<uint64_t> mFree_summary;
+			size_t mFree_count = 0;
+			TLE_Entry mNext_fit = 0;
+
+			size_t Le_Entries_Per_Cluster();
+			void Build_Free_Index();
+			void Set_Free(TLE_Entry entry, bool free);
+			size_t Find_Free(size_t from);
+			size_t Free_Run_Length(size_t first, size_t max_length);
+			// Request submitted to the HAL queue, its buffer is owned by the submitter until completion
+			struct TAsync_Request {
+				kiv_hal::TDisk_Request request;
+				TAsync_Completion on_completion;
+			};
+			std::vector<TAsync_Request *> mAsync_in_flight;
+
+			// Cluster cache, all cluster reads and writes except the LE table go through it
+			struct TCached_Cluster {
+				std::vector<char> data;
+				bool dirty;
+				bool metadata; // Written by a directory, goes through the journal
+				std::list<uint64_t>::iterator lru_position;
+			};
+			std::unordered_map<uint64_t, TCached_Cluster> mCache;
+			std::list<uint64_t> mCache_lru; // Most recently used first
+			// Clusters marked clean whose write is still in progress, they cannot be evicted and read back from the disk yet
+			std::set<uint64_t> mCache_writing;
+			size_t mCache_capacity;
+			TCluster_Cache_Statistics mCache_statistics;
+
+			// Clusters read ahead. Requested ones wait for their asynchronous read, finished ones wait here until a read
+			// moves them to the cache. Writing or dropping a cluster cancels its readahead, it would bring back an old copy.
+			std::set<uint64_t> mReadahead_in_flight;
+			std::map<uint64_t, std::vector<char>> mReadahead_ready;
+
+			// Dentry cache, (directory, name) -> directory entry. Negative entries remember missing names.
+			// Directory is identified by its first cluster, see IDirectory::Dentry_Key.
+			struct TDentry {
+				bool exists;
+				TLE_Dir_Entry entry;
+			};
+			std::map<std::pair<TLE_Entry, std::string>, TDentry> mDentries;
+			size_t mDentry_hits = 0;
+			size_t mDentry_misses = 0;
+
+			// Group commit, threads asking for a sync while one is running share the next one
+			std::mutex mCommit_lock;
+			std::condition_variable mCommit_condition;
+			uint64_t mCommit_requested = 0;
+			uint64_t mCommit_completed = 0;
+			bool mCommit_running = false;
+			bool mCommit_result = true;
+
+			// Write-ahead journal of metadata clusters (LE table and directories), guarded by the write-back lock.
+			// Committed copies wait in memory until a checkpoint writes them to their places. They are changed
+			// under both the write-back and the cache lock, so reads of the cache may use them under the cache lock only.
+			bool mJournal_enabled = false;
+			uint64_t mJournal_sequence = 0; // Sequence number of the next transaction
+			size_t mJournal_head = 1; // Next free cluster of the log, relative to the journal region
+			std::map<uint64_t, std::vector<char>> mJournal_pending;
+			size_t mJournal_transactions = 0;
+			size_t mJournal_logged = 0;
+			size_t mJournal_checkpoints = 0;
+
+			// Open files whose size was not written to the parent directory yet, see CFile::Flush_Metadata
+			std::map<CFile *, std::weak_ptr<CFile>> mDirty_files;
+
+			// Dirty LE table clusters copied out of the table, written without holding the allocator lock
+			struct TLe_Table_Snapshot {
+				std::vector<uint64_t> clusters;
+				std::vector<char> data;
+			};
+
+			// Dirty cached clusters copied out of the cache, marked clean and kept in it until they are written
+			struct TCache_Copies {
+				std::vector<uint64_t> clusters;
+				std::vector<char> data;
+			};
+
+			void Take_Le_Table_Snapshot(TLe_Table_Snapshot &snapshot);
+			bool Write_Le_Table_Snapshot(TLe_Table_Snapshot &snapshot);
+			void Mark_Le_Table_Dirty(const TLe_Table_Snapshot &snapshot);
+
+			bool Commit_Metadata();
+			bool Write_Journal(const std::vector<uint64_t> &clusters, const std::vector<char *> &copies);
+			size_t Read_Journal_Transaction(size_t position, uint64_t sequence, std::map<uint64_t, std::vector<char>> &copies);
+			bool Checkpoint_Journal();
+			bool Checkpoint_Journal_If_Pending(const std::vector<uint64_t> &clusters);
+			bool Write_Journal_Header();
+			size_t Journal_Descriptor_Capacity();
+			bool Is_Journal_Home(uint64_t cluster);
+			bool Flush_Device();
+
+			bool Cached_Read(const std::vector<char *> &buffers, const std::vector<uint64_t> &clusters);
+			bool Cached_Write(const std::vector<char *> &buffers, const std::vector<uint64_t> &clusters, bool metadata);
+			TCached_Cluster *Cache_Lookup(uint64_t cluster);
+			bool Cache_Insert(uint64_t cluster, const char *data, bool dirty, bool metadata = false);
+			bool Cache_Evict();
+			bool Cache_Shrink();
+			void Cache_Drop(uint64_t first_cluster, uint64_t num_of_clusters);
+			void Take_Dirty_Clusters(TCache_Copies &copies, uint64_t first_cluster, uint64_t num_of_clusters, bool data, bool metadata);
+			void Release_Dirty_Clusters(const TCache_Copies &copies, bool written);
+			bool Write_Dirty_Clusters(TCache_Copies &copies);
+			void Discard_Committed_Clusters(std::vector<TLE_Entry> &le_entries, bool committed);
+			void Read_Ahead_Completed(uint64_t first_cluster, uint64_t num_of_clusters, const char *data, bool success);
+			void Wait_For_Read_Ahead(const std::vector<uint64_t> &clusters);
+			void Cancel_Read_Ahead(uint64_t cluster);
+
+			std::vector<char *> Contiguous_Buffers(char *buffer, size_t num_of_clusters);
+			std::vector<uint64_t> Cluster_Range(uint64_t first_cluster, uint64_t num_of_clusters);
+			std::vector<uint64_t> Data_Clusters(const std::vector<TLE_Entry> &le_entries);
+			bool Vectored_Disk_IO(kiv_hal::NDisk_IO operation, const std::vector<char *> &buffers, const std::vector<uint64_t> &clusters);
+			bool Submit_To_Disk(kiv_hal::NDisk_IO operation, char *buffer, uint64_t first_sector, uint64_t num_of_sectors, TAsync_Completion on_completion);
+	};
+
+	// Scope of one metadata operation (allocation or freeing of clusters together with the directory changes it belongs to).
+	// Commits wait for running operations, so a transaction never contains a half done one. Nested scopes of a thread share the outermost one.
+	class CMetadata_Operation {
+		public:
+			CMetadata_Operation(CLE_Utils *utils);
+			~CMetadata_Operation();
+
+		private:
+			CLE_Utils *mUtils;
 	};
 
 	// Abstract directory (root and subdirectories)
 	class IDirectory : public kiv_vfs::IFile {
 		public:
-			IDirectory(CLE_Utils *utils, std::recursive_mutex *fs_lock);
+			IDirectory(CLE_Utils *utils, TLE_Entry key);
 			virtual kiv_os::NOS_Error Read(char *buffer, size_t buffer_size, size_t position, size_t &read) final override;
 
 			virtual bool Is_Empty() final override;
@@ -81,22 +340,45 @@ namespace kiv_fs_linked_entries {
 			virtual bool Load() = 0;
 			virtual bool Save() = 0;
 			virtual std::shared_ptr<kiv_vfs::IFile> Make_File(kiv_vfs::TPath path, TLE_Dir_Entry entry) = 0;
+			virtual TLE_Entry Dentry_Key() = 0;
+
+			// Held while the entries are loaded, changed and saved
+			std::recursive_mutex &Get_Lock();
 
 		protected:
-			std::vector<TLE_Dir_Entry> mEntries;
-			uint32_t mSize;
+			// Members below refer to the contents shared with the other objects of the directory
+			std::shared_ptr<TDirectory_Contents> mContents;
+			std::vector<TLE_Dir_Entry> &mEntries;
+			std::unordered_map<TLE_Name, size_t, TLE_Name_Hash> &mIndex; // Name -> position in mEntries
+			std::set<size_t> mDirty_clusters; // Clusters (in the order of the directory) changed since Load
+			std::vector<TLE_Entry> &mChain; // Data clusters holding the entries
+			uint32_t &mSize;
 			CLE_Utils *mUtils;
-			std::recursive_mutex *mFs_lock;
+			std::shared_ptr<std::recursive_mutex> mDir_lock;
+
+			// Position of the cluster holding the entry, in the order of the directory
+			virtual size_t Entry_Cluster(size_t entry_index) = 0;
+
+			size_t Entries_Per_Cluster();
+			size_t Find_Index(const std::string &filename);
+			void Clear_Entries();
+			void Rebuild_Index();
+			void Mark_Dirty(size_t entry_index);
+			std::vector<size_t> Clusters_To_Save(size_t num_of_clusters);
 	};
 
 	// Subdirectory
 	class CDirectory : public IDirectory {
 		public:
-			CDirectory(kiv_vfs::TPath path, TLE_Dir_Entry &dir_entry, std::vector<TLE_Dir_Entry> dirs_to_parent, CLE_Utils *utils, std::recursive_mutex *fs_lock);
-			CDirectory(TLE_Dir_Entry &dir_entry, CLE_Utils *utils, std::recursive_mutex *fs_lock);
+			CDirectory(kiv_vfs::TPath path, TLE_Dir_Entry &dir_entry, std::vector<TLE_Dir_Entry> dirs_to_parent, CLE_Utils *utils);
+			CDirectory(TLE_Dir_Entry &dir_entry, CLE_Utils *utils);
 			virtual bool Load() override final;
 			virtual bool Save() override final;
 			virtual std::shared_ptr<kiv_vfs::IFile> Make_File(kiv_vfs::TPath path, TLE_Dir_Entry entry) override final;
+			virtual TLE_Entry Dentry_Key() override final;
+
+		protected:
+			virtual size_t Entry_Cluster(size_t entry_index) override final;
 
 		private:
 			TLE_Dir_Entry mDir_entry;
@@ -106,42 +388,84 @@ namespace kiv_fs_linked_entries {
 	// Root directory
 	class CRoot : public IDirectory {
 		public:
-			CRoot(CLE_Utils *utils, std::recursive_mutex *fs_lock);
+			CRoot(CLE_Utils *utils);
 			virtual bool Load() override final;
 			virtual bool Save() override final;
 			virtual std::shared_ptr<kiv_vfs::IFile> Make_File(kiv_vfs::TPath path, TLE_Dir_Entry entry) override final;
+			virtual TLE_Entry Dentry_Key() override final;
+
+		protected:
+			// Root cluster holds the first entries, the rest continues in a chain of data clusters
+			virtual size_t Entry_Cluster(size_t entry_index) override final;
+
+		private:
+			size_t First_Cluster_Entries();
 	};
 
 	// File
-	class CFile : public kiv_vfs::IFile {
+	class CFile : public kiv_vfs::IFile, public std::enable_shared_from_this<CFile> {
 		public:
-			CFile(const kiv_vfs::TPath path, TLE_Dir_Entry &dir_entry, std::vector<TLE_Dir_Entry> dirs_to_parent, CLE_Utils *utils, std::recursive_mutex *fs_lock);
+			CFile(const kiv_vfs::TPath path, TLE_Dir_Entry &dir_entry, std::vector<TLE_Dir_Entry> dirs_to_parent, CLE_Utils *utils);
+			~CFile();
 
 			virtual kiv_os::NOS_Error Write(const char *buffer, size_t buffer_size, size_t position, size_t &written) final override;
 			virtual kiv_os::NOS_Error Read(char *buffer, size_t buffer_size, size_t position, size_t &read) final override;
 			virtual kiv_os::NOS_Error Resize(size_t size) final override;
 			virtual bool Is_Available_For_Write() final override;
 			virtual size_t Get_Size() final override;
+			virtual void Close(const kiv_vfs::TFD_Attributes attrs) final override;
+			// Writes the size held in memory to the parent directory
+			bool Flush_Metadata();
 
 		private:
+			// Clusters of one request, the partially covered first and last cluster use temporary buffers.
+			// Clusters zeroed between the end of the file and the request share one buffer of zeros.
+			struct TCluster_Buffers {
+				std::vector<TLE_Entry> entries;
+				std::vector<char *> targets;
+				std::vector<char> first_partial;
+				std::vector<char> last_partial;
+				std::vector<char> old_last;
+				std::vector<char> zeros;
+			};
+
 			std::string filename;
 			uint32_t mSize;
+			// Size was changed and the parent directory entry still holds the old one
+			bool mSize_dirty = false;
 			std::vector<TLE_Entry> mLe_entries;
 			std::vector<TLE_Dir_Entry> mDirs_to_parent;
 			CLE_Utils *mUtils;
-			std::recursive_mutex *mFs_lock;
+			// Readers of the data share it, writing and resizing hold it exclusively
+			std::shared_timed_mutex mData_lock;
+
+			// Sequential reading of the file (shared by all its handles), readers holding the shared data lock update it under its own lock
+			std::mutex mReadahead_lock;
+			size_t mReadahead_next = 0; // Position right after the last read
+			size_t mReadahead_window = 0; // Clusters requested ahead at once, grows while the reading stays sequential
+			size_t mReadahead_end = 0; // Index in mLe_entries of the first cluster not requested yet
+
+			bool Write_Size_To_Parent();
+			void Map_Cluster_Buffers(char *buffer, size_t position, size_t size, TCluster_Buffers &clusters);
+			bool Map_Zero_Fill(size_t end_cluster, TCluster_Buffers &clusters);
+			void Mark_Size_Dirty();
+			void Read_Ahead(size_t position, size_t read, size_t last_cluster);
 	};
 
 	class CFile_System : public kiv_vfs::IFile_System {
 		public:
-			CFile_System();
+			CFile_System(size_t cache_capacity = DEFAULT_CLUSTER_CACHE_CAPACITY);
 			virtual kiv_vfs::IMounted_File_System *Create_Mount(const std::string label, const kiv_vfs::TDisk_Number disk_number) final override;
+
+		private:
+			size_t mCache_capacity;
 	};
 
 	class CMount : public kiv_vfs::IMounted_File_System {
 		public:
-			CMount(std::string label, kiv_vfs::TDisk_Number disk_number);
+			CMount(std::string label, kiv_vfs::TDisk_Number disk_number, size_t cache_capacity);
 			~CMount();
+			virtual std::string Get_Statistics() final override;
 			virtual kiv_os::NOS_Error Open_File(const kiv_vfs::TPath &path, kiv_os::NFile_Attributes attributes, std::shared_ptr<kiv_vfs::IFile> &file) final override;
 			virtual kiv_os::NOS_Error Create_File(const kiv_vfs::TPath &path, kiv_os::NFile_Attributes attributes, std::shared_ptr<kiv_vfs::IFile> &file) final override;
 			virtual kiv_os::NOS_Error Delete_File(const kiv_vfs::TPath &path) final override;
@@ -151,14 +475,23 @@ namespace kiv_fs_linked_entries {
 			TSuperblock mSuperblock{};
 			std::shared_ptr<CRoot> root;
 			CLE_Utils *mUtils;
-			std::recursive_mutex *mFs_lock;
 
+			// Periodically writes back dirty metadata
+			std::thread mSync_thread;
+			std::mutex mSync_mutex;
+			std::condition_variable mSync_condition;
+			bool mSync_stop = false;
+
+			void Sync_Loop();
+			kiv_os::NOS_Error Create_Entry(const kiv_vfs::TPath &path, kiv_os::NFile_Attributes attributes, std::shared_ptr<kiv_vfs::IFile> &file);
+			kiv_os::NOS_Error Delete_Entry(const kiv_vfs::TPath &path);
 			bool Load_Superblock(kiv_hal::TDrive_Parameters &params);
 			bool Chech_Superblock();
 			bool Format_Disk(kiv_hal::TDrive_Parameters &params);
 			bool Load_Disk_Params(kiv_hal::TDrive_Parameters &params);
 			bool Init_Le_Table();
 			bool Init_Root();
+			bool Init_Journal();
 	};
 
 }
\ No newline at end of file
@@ -1,9 +1,11 @@
 #include "fs_proc.h"
 #include "process.h"
 
+#include <algorithm>
 #include <sstream>
 
 const size_t file_name_size = 12;
+const char *disk_file_name = "disk";
 
 namespace kiv_fs_proc {
 
@@ -14,7 +16,7 @@ namespace kiv_fs_proc {
 	}
 
 	kiv_vfs::IMounted_File_System *CFile_System::Create_Mount(const std::string label, const kiv_vfs::TDisk_Number disk_number) {
-		return new CMount(label);
+		return new CMount(label, disk_number);
 	}
 
 #pragma endregion
@@ -49,6 +51,80 @@ namespace kiv_fs_proc {
 	}
 #pragma endregion
 
+#pragma region Disk file
+	CDisk_File::CDisk_File(const kiv_vfs::TPath path, kiv_vfs::TDisk_Number disk_number) {
+		mPath = path;
+		mAttributes = kiv_os::NFile_Attributes::Read_Only;
+
+		kiv_hal::TDisk_Statistics statistics{};
+		kiv_hal::TRegisters regs;
+		regs.rax.h = static_cast<decltype(regs.rax.h)>(kiv_hal::NDisk_IO::Drive_Statistics);
+		regs.rdx.l = static_cast<decltype(regs.rdx.l)>(disk_number);
+		regs.rdi.r = reinterpret_cast<decltype(regs.rdi.r)>(&statistics);
+		kiv_hal::Call_Interrupt_Handler(kiv_hal::NInterrupt::Disk_IO, regs);
+
+		std::ostringstream oss;
+		oss << "disk 0x" << std::hex << static_cast<unsigned>(disk_number) << std::dec << "\n";
+
+		if (regs.flags.carry) {
+			oss << "statistics are not available\n";
+		}
+		else if (!statistics.enabled) {
+			oss << "resident: " << statistics.resident_bytes << " B\n";
+			oss << "virtual clock: " << statistics.virtual_clock_us << " us\n";
+			oss << "statistics are not collected (set Statistics=true in boot.ini)\n";
+		}
+		else {
+			auto print = [&oss](const char *name, const kiv_hal::TDisk_Operation_Statistics &stats) {
+				oss << name << ": " << stats.operations << " ops, " << stats.sectors << " sectors, "
+					<< stats.sequential << " sequential, " << stats.total_latency_us << " us\n";
+				for (size_t i = 0; i < kiv_hal::Disk_Latency_Buckets; i++) {
+					if (stats.latency_histogram[i] > 0) {
+						oss << "\t<" << (1ull << (i + 1)) << " us\t" << stats.latency_histogram[i] << "\n";
+					}
+				}
+			};
+			print("reads", statistics.reads);
+			print("writes", statistics.writes);
+			oss << "resident: " << statistics.resident_bytes << " B\n";
+			oss << "virtual clock: " << statistics.virtual_clock_us << " us\n";
+		}
+
+		if (!regs.flags.carry) {
+			oss << "discarded: " << statistics.discarded_sectors << " sectors\n";
+		}
+
+		if (!regs.flags.carry && statistics.cache.enabled) {
+			oss << "cache: " << statistics.cache.hits << " hits, " << statistics.cache.misses << " misses, "
+				<< statistics.cache.written_back << " sectors written back in " << statistics.cache.write_back_runs << " runs\n";
+		}
+
+		// File system level caches of the mounts
+		oss << kiv_vfs::CVirtual_File_System::Get_Instance().Get_Mount_Statistics();
+
+		mContent = oss.str();
+	}
+
+	kiv_os::NOS_Error CDisk_File::Read(char *buffer, size_t buffer_size, size_t position, size_t &read) {
+		if (position >= mContent.length()) {
+			read = 0;
+			return kiv_os::NOS_Error::Success;
+		}
+
+		read = (std::min)(buffer_size, mContent.length() - position);
+		memcpy(buffer, mContent.data() + position, read);
+		return kiv_os::NOS_Error::Success;
+	}
+
+	bool CDisk_File::Is_Available_For_Write() {
+		return false;
+	}
+
+	size_t CDisk_File::Get_Size() {
+		return mContent.length();
+	}
+#pragma endregion
+
 #pragma region Directory
 	CDirectory::CDirectory(const kiv_vfs::TPath path, const std::map<size_t, std::string> &processes) : mProcesses(processes) {
 		mPath = path;
@@ -96,7 +172,7 @@ namespace kiv_fs_proc {
 #pragma endregion
 
 #pragma region Mount
-	CMount::CMount(std::string label) { 
+	CMount::CMount(std::string label, kiv_vfs::TDisk_Number disk_number) : mDisk_Number(disk_number) { 
 		mLabel = label;
 		kiv_vfs::TPath path;
 		path.mount = label;
@@ -114,6 +190,11 @@ namespace kiv_fs_proc {
 			return kiv_os::NOS_Error::Success;
 		}
 
+		if (path.file == disk_file_name) {
+			file = std::make_shared<CDisk_File>(path, mDisk_Number);
+			return kiv_os::NOS_Error::Success;
+		}
+
 		std::istringstream iss(path.file);
 		size_t pid;
 		iss >> pid;
@@ -5,6 +5,7 @@
 namespace kiv_fs_proc {
 
 	class CFile;
+	class CDisk_File;
 	class CFile_System;
 	class CMount;
 
@@ -19,6 +20,18 @@ namespace kiv_fs_proc {
 			std::string mName;
 	};
 
+	// Text snapshot of the HAL statistics of the mounted disk and of the file system caches
+	class CDisk_File : public kiv_vfs::IFile {
+		public:
+			CDisk_File(const kiv_vfs::TPath path, kiv_vfs::TDisk_Number disk_number);
+			virtual kiv_os::NOS_Error Read(char *buffer, size_t buffer_size, size_t position, size_t &read) final override;
+			virtual bool Is_Available_For_Write() final override;
+			virtual size_t Get_Size() final override;
+
+		private:
+			std::string mContent;
+	};
+
 	class CDirectory : public kiv_vfs::IFile {
 	public:
 		CDirectory(const kiv_vfs::TPath path, const std::map<size_t, std::string> &processes);
@@ -42,11 +55,12 @@ namespace kiv_fs_proc {
 
 	class CMount : public kiv_vfs::IMounted_File_System {
 		public:
-			CMount(std::string label);
+			CMount(std::string label, kiv_vfs::TDisk_Number disk_number);
 			virtual kiv_os::NOS_Error Open_File(const kiv_vfs::TPath &path, kiv_os::NFile_Attributes attributes, std::shared_ptr<kiv_vfs::IFile> &file) final override;
 
 		private:
 			std::shared_ptr<kiv_vfs::IFile> mRoot;
+			kiv_vfs::TDisk_Number mDisk_Number;
 	};
 
 }
\ No newline at end of file
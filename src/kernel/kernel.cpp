@@ -16,6 +16,11 @@ HMODULE User_Programs;
 
 static const int NO_DISK = -1;
 
+// Kernel settings live in the [Kernel] section of boot.ini, next to the drive sections read by the HAL
+static const wchar_t *CONFIG_NAME = L"boot.ini";
+static const wchar_t *KERNEL_SECTION = L"Kernel";
+static const wchar_t *LE_CACHE_CLUSTERS = L"LE_Cache_Clusters";
+
 int Get_Disk_Number() {
 	kiv_hal::TRegisters regs;
 	for (regs.rdx.l = 0; ; regs.rdx.l++) {
@@ -34,6 +39,25 @@ int Get_Disk_Number() {
 	}
 }
 
+size_t Get_Kernel_Setting(const wchar_t *key, size_t default_value, size_t max_value) {
+	// boot.ini is in the directory of the boot executable
+	std::wstring path(1024, L'\0');
+	DWORD length = GetModuleFileNameW(nullptr, &path[0], static_cast<DWORD>(path.size()));
+	if (length == 0 || length >= path.size()) {
+		return default_value;
+	}
+	path.resize(path.find_last_of(L"\\/", length) + 1);
+	path += CONFIG_NAME;
+
+	// Negative values come back as huge unsigned ones, those and other values out of range are ignored
+	INT value = static_cast<INT>(GetPrivateProfileIntW(KERNEL_SECTION, key, static_cast<INT>(default_value), path.c_str()));
+	if (value < 0 || static_cast<size_t>(value) > max_value) {
+		return default_value;
+	}
+
+	return static_cast<size_t>(value);
+}
+
 void Print_Error(char *message, size_t message_length) {
 	kiv_hal::TRegisters registers;
 	registers.rax.h = static_cast<decltype(registers.rax.h)>(kiv_hal::NVGA_BIOS::Write_String);
@@ -56,14 +80,15 @@ void Initialize_Kernel() {
 	 * Registering all known file systems crucial for kernel
 	 */
 	kiv_vfs::CVirtual_File_System::Get_Instance().Register_File_System(new kiv_fs_stdio::CFile_System());
-	kiv_vfs::CVirtual_File_System::Get_Instance().Register_File_System(new kiv_fs_linked_entries::CFile_System());
+	kiv_vfs::CVirtual_File_System::Get_Instance().Register_File_System(new kiv_fs_linked_entries::CFile_System(
+		Get_Kernel_Setting(LE_CACHE_CLUSTERS, kiv_fs_linked_entries::DEFAULT_CLUSTER_CACHE_CAPACITY, kiv_fs_linked_entries::MAX_CLUSTER_CACHE_CAPACITY)));
 	kiv_vfs::CVirtual_File_System::Get_Instance().Register_File_System(new kiv_fs_proc::CFile_System());
 
 	/*
 	 * Mounting registered file systems
 	 */
 	kiv_vfs::CVirtual_File_System::Get_Instance().Mount_File_System("stdio", "stdio");
-	kiv_vfs::CVirtual_File_System::Get_Instance().Mount_File_System("fs_proc", "proc");
+	kiv_vfs::CVirtual_File_System::Get_Instance().Mount_File_System("fs_proc", "proc", disk_number);
 	if (!kiv_vfs::CVirtual_File_System::Get_Instance().Mount_File_System("le", "C", disk_number)) {
 		char *err_msg = "Couldn't mount 'Linked Entries' file system.\n";
 		Print_Error(err_msg, strlen(err_msg));
@@ -114,6 +114,9 @@ namespace kiv_vfs {
 	kiv_os::NOS_Error IMounted_File_System::Delete_File(const TPath &path) {
 		return kiv_os::NOS_Error::Unknown_Error;
 	}
+	std::string IMounted_File_System::Get_Statistics() {
+		return "";
+	}
 
 #pragma endregion
 
@@ -188,6 +191,20 @@ namespace kiv_vfs {
 		return false;
 	}
 
+	std::string CVirtual_File_System::Get_Mount_Statistics() {
+		std::unique_lock<std::mutex> lock(mMounted_fs_lock);
+
+		std::string statistics;
+		for (auto mount : mMounted_file_systems) {
+			std::string mount_statistics = mount.second->Get_Statistics();
+			if (!mount_statistics.empty()) {
+				statistics += "mount " + mount.first + ":\n" + mount_statistics;
+			}
+		}
+
+		return statistics;
+	}
+
 	void CVirtual_File_System::Unregister_All() {
 		for (auto fs : mRegistered_file_systems) {
 			delete fs;
@@ -98,6 +98,8 @@ namespace kiv_vfs {
 			virtual kiv_os::NOS_Error Open_File(const TPath &path, kiv_os::NFile_Attributes attributes, std::shared_ptr<IFile> &file);
 			virtual kiv_os::NOS_Error Create_File(const TPath &path, kiv_os::NFile_Attributes attributes, std::shared_ptr<IFile> &file);
 			virtual kiv_os::NOS_Error Delete_File(const TPath &path);
+			// Text describing runtime statistics of the mount, empty when there are none
+			virtual std::string Get_Statistics();
 			std::string Get_Label();
 			bool Is_Mounted();
 		
@@ -146,6 +148,7 @@ namespace kiv_vfs {
 			 */
 			bool Register_File_System(IFile_System *fs);
 			bool Mount_File_System(std::string fs_name, std::string label, TDisk_Number = 0);
+			std::string Get_Mount_Statistics();
 
 		private:
 			static std::recursive_mutex mFd_lock;
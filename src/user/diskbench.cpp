@@ -0,0 +1,411 @@
+#include "..\api\api.h"
+#include "rtl.h"
+#include "common.h"
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+#include <cstdio>
+#include <cctype>
+#include <algorithm>
+#include <limits>
+
+namespace {
+	const size_t Random_Block_Size = 4096;
+
+	// File names have at most 11 characters including the dot ("bench99.dat", "m99_9999")
+	const size_t Max_Threads = 99;
+	const size_t Max_Metadata_Files = 9999;
+
+	enum class NBench_Phase {
+		Sequential_Write,
+		Sequential_Read,
+		Random_Write,
+		Random_Read,
+		Create,
+		Open,
+		Delete
+	};
+
+	const char *Phase_Names[] = { "seq write", "seq read", "rand 4K write", "rand 4K read", "create", "open", "delete" };
+
+	struct TBench_Config {
+		std::string directory;
+		size_t buffer_size = 64 * 1024;
+		size_t file_size = 4 * 1024 * 1024;
+		size_t threads = 1;
+		size_t metadata_files = 16;
+	};
+
+	// Results of one thread in one phase
+	struct TBench_Result {
+		bool failed = false;
+		size_t operations = 0;
+		size_t bytes = 0;
+		double total_us = 0.0;
+		double max_us = 0.0;
+	};
+
+	// Worker threads receive only their index (the kernel copies thread data as a string),
+	// everything else is shared through these globals
+	TBench_Config config;
+	NBench_Phase phase;
+	std::vector<TBench_Result> results;
+
+	using TClock = std::chrono::high_resolution_clock;
+
+	double Elapsed_us(const TClock::time_point &start) {
+		return std::chrono::duration<double, std::micro>(TClock::now() - start).count();
+	}
+
+	void Record(TBench_Result &result, const TClock::time_point &start, const size_t bytes) {
+		const double elapsed = Elapsed_us(start);
+		result.operations++;
+		result.bytes += bytes;
+		result.total_us += elapsed;
+		result.max_us = (std::max)(result.max_us, elapsed);
+	}
+
+	std::string File_Path(const std::string &name) {
+		if (config.directory.empty()) {
+			return name;
+		}
+
+		const char last = config.directory.back();
+		if (last == '\\' || last == '/' || last == ':') {
+			return config.directory + name;
+		}
+
+		return config.directory + "\\" + name;
+	}
+
+	std::string Data_File_Name(const size_t thread) {
+		return File_Path("bench" + std::to_string(thread) + ".dat");
+	}
+
+	std::string Metadata_File_Name(const size_t thread, const size_t index) {
+		return File_Path("m" + std::to_string(thread) + "_" + std::to_string(index));
+	}
+
+	bool Sequential(const size_t thread, TBench_Result &result, const bool write) {
+		kiv_os::THandle handle;
+		const kiv_os::NOpen_File flags = write ? static_cast<kiv_os::NOpen_File>(0) : kiv_os::NOpen_File::fmOpen_Always;
+		if (!kiv_os_rtl::Open_File(Data_File_Name(thread).c_str(), flags, static_cast<kiv_os::NFile_Attributes>(0), handle)) {
+			return false;
+		}
+
+		std::vector<char> buffer(config.buffer_size, static_cast<char>('a' + thread % 26));
+		bool success = true;
+
+		for (size_t done = 0; success && done < config.file_size; ) {
+			const size_t chunk = (std::min)(config.buffer_size, config.file_size - done);
+			size_t transferred = 0;
+
+			const auto start = TClock::now();
+			success = write ? kiv_os_rtl::Write_File(handle, buffer.data(), chunk, transferred)
+				: kiv_os_rtl::Read_File(handle, buffer.data(), chunk, transferred);
+			success = success && transferred != 0;
+			if (success) {
+				Record(result, start, transferred);
+				done += transferred;
+			}
+		}
+
+		kiv_os_rtl::Close_Handle(handle);
+		return success;
+	}
+
+	bool Random(const size_t thread, TBench_Result &result, const bool write) {
+		const size_t blocks = config.file_size / Random_Block_Size;
+		if (blocks == 0) {
+			return true;
+		}
+
+		kiv_os::THandle handle;
+		if (!kiv_os_rtl::Open_File(Data_File_Name(thread).c_str(), kiv_os::NOpen_File::fmOpen_Always, static_cast<kiv_os::NFile_Attributes>(0), handle)) {
+			return false;
+		}
+
+		std::mt19937 generator(static_cast<unsigned>(thread + 1));
+		std::uniform_int_distribution<size_t> block(0, blocks - 1);
+		std::vector<char> buffer(Random_Block_Size, static_cast<char>('A' + thread % 26));
+		bool success = true;
+
+		for (size_t i = 0; success && i < blocks; i++) {
+			size_t transferred = 0;
+
+			const auto start = TClock::now();
+			success = kiv_common::Set_Position(handle, block(generator) * Random_Block_Size, kiv_os::NFile_Seek::Beginning);
+			if (success) {
+				success = write ? kiv_os_rtl::Write_File(handle, buffer.data(), buffer.size(), transferred)
+					: kiv_os_rtl::Read_File(handle, buffer.data(), buffer.size(), transferred);
+			}
+			success = success && transferred == buffer.size();
+			if (success) {
+				Record(result, start, transferred);
+			}
+		}
+
+		kiv_os_rtl::Close_Handle(handle);
+		return success;
+	}
+
+	bool Metadata(const size_t thread, TBench_Result &result) {
+		bool success = true;
+
+		for (size_t i = 0; success && i < config.metadata_files; i++) {
+			const std::string name = Metadata_File_Name(thread, i);
+			kiv_os::THandle handle;
+
+			const auto start = TClock::now();
+			switch (phase) {
+				case NBench_Phase::Create:
+					success = kiv_os_rtl::Open_File(name.c_str(), static_cast<kiv_os::NOpen_File>(0), static_cast<kiv_os::NFile_Attributes>(0), handle);
+					success = success && kiv_os_rtl::Close_Handle(handle);
+					break;
+				case NBench_Phase::Open:
+					success = kiv_os_rtl::Open_File(name.c_str(), kiv_os::NOpen_File::fmOpen_Always, static_cast<kiv_os::NFile_Attributes>(0), handle);
+					success = success && kiv_os_rtl::Close_Handle(handle);
+					break;
+				default:
+					success = kiv_os_rtl::Delete_File(name.c_str());
+					break;
+			}
+
+			if (success) {
+				Record(result, start, 0);
+			}
+		}
+
+		return success;
+	}
+
+	size_t _stdcall Bench_Thread(const kiv_hal::TRegisters &context) {
+		const size_t thread = std::stoul(reinterpret_cast<const char *>(context.rdi.r));
+		TBench_Result &result = results[thread];
+
+		bool success;
+		switch (phase) {
+			case NBench_Phase::Sequential_Write:
+				success = Sequential(thread, result, true);
+				break;
+			case NBench_Phase::Sequential_Read:
+				success = Sequential(thread, result, false);
+				break;
+			case NBench_Phase::Random_Write:
+				success = Random(thread, result, true);
+				break;
+			case NBench_Phase::Random_Read:
+				success = Random(thread, result, false);
+				break;
+			default:
+				success = Metadata(thread, result);
+				break;
+		}
+
+		result.failed = !success;
+		kiv_os_rtl::Exit(success ? EXIT_SUCCESS : EXIT_FAILURE);
+
+		return 0;
+	}
+
+	// Runs one phase on all threads at once, returns wall clock time of the whole phase
+	bool Run_Phase(const NBench_Phase bench_phase, double &wall_us) {
+		phase = bench_phase;
+		results.assign(config.threads, TBench_Result());
+
+		std::vector<std::string> thread_args;
+		for (size_t i = 0; i < config.threads; i++) {
+			thread_args.push_back(std::to_string(i));
+		}
+
+		const auto start = TClock::now();
+
+		std::vector<size_t> handles;
+		for (size_t i = 0; i < config.threads; i++) {
+			size_t handle;
+			if (!kiv_os_rtl::Thread(Bench_Thread, thread_args[i].c_str(), handle)) {
+				results[i].failed = true;
+				continue;
+			}
+			handles.push_back(handle);
+		}
+
+		size_t signaled;
+		int exit_code;
+		bool joined = true;
+		while (!handles.empty()) {
+			if (!kiv_os_rtl::Wait_For(&handles[0], handles.size(), signaled)) {
+				// Running threads still write their results, each of them is waited for before the results are read
+				for (const size_t handle : handles) {
+					if (kiv_os_rtl::Wait_For(&handle, 1, signaled)) {
+						kiv_os_rtl::Read_Exit_Code(handle, exit_code);
+					}
+				}
+				joined = false;
+				break;
+			}
+
+			handles.erase(std::remove(handles.begin(), handles.end(), signaled), handles.end());
+			kiv_os_rtl::Read_Exit_Code(signaled, exit_code);
+		}
+
+		wall_us = Elapsed_us(start);
+
+		return joined && std::none_of(results.begin(), results.end(), [](const TBench_Result &result) { return result.failed; });
+	}
+
+	void Print_Row(const kiv_hal::TRegisters &regs, const NBench_Phase bench_phase, const double wall_us) {
+		TBench_Result total;
+		for (const auto &result : results) {
+			total.operations += result.operations;
+			total.bytes += result.bytes;
+			total.total_us += result.total_us;
+			total.max_us = (std::max)(total.max_us, result.max_us);
+		}
+
+		const double seconds = wall_us / 1000000.0;
+		const double average_us = total.operations != 0 ? total.total_us / total.operations : 0.0;
+
+		char line[128];
+		int length;
+		if (total.bytes != 0) {
+			length = snprintf(line, sizeof(line), "%-14s %10zu %12.2f %12s %12.1f %12.1f\n", Phase_Names[static_cast<int>(bench_phase)],
+				total.operations, seconds > 0.0 ? total.bytes / seconds / (1024.0 * 1024.0) : 0.0, "-", average_us, total.max_us);
+		}
+		else {
+			length = snprintf(line, sizeof(line), "%-14s %10zu %12s %12.0f %12.1f %12.1f\n", Phase_Names[static_cast<int>(bench_phase)],
+				total.operations, "-", seconds > 0.0 ? total.operations / seconds : 0.0, average_us, total.max_us);
+		}
+
+		kiv_os_rtl::Stdout_Print(regs, line, length);
+	}
+
+	// Accepts plain non-zero decimal numbers
+	bool Parse_Count(const std::string &digits, size_t &count) {
+		// Longer numbers would not fit into size_t
+		if (digits.empty() || digits.length() > static_cast<size_t>(std::numeric_limits<size_t>::digits10)
+			|| !std::all_of(digits.begin(), digits.end(), ::isdigit)) {
+			return false;
+		}
+
+		count = static_cast<size_t>(std::stoull(digits));
+		return count != 0;
+	}
+
+	// Accepts plain byte counts with an optional K or M suffix
+	bool Parse_Size(const std::string &text, size_t &size) {
+		if (text.empty()) {
+			return false;
+		}
+
+		size_t multiplier = 1;
+		std::string digits = text;
+		switch (digits.back()) {
+			case 'k': case 'K':
+				multiplier = 1024;
+				digits.pop_back();
+				break;
+			case 'm': case 'M':
+				multiplier = 1024 * 1024;
+				digits.pop_back();
+				break;
+		}
+
+		size_t value;
+		if (!Parse_Count(digits, value) || value > (std::numeric_limits<size_t>::max)() / multiplier) {
+			return false;
+		}
+
+		size = value * multiplier;
+		return true;
+	}
+
+	bool Parse_Config(const std::vector<std::string> &args) {
+		for (size_t i = 1; i < args.size(); i++) {
+			if (i + 1 >= args.size()) {
+				return false;
+			}
+
+			const std::string &option = args[i];
+			const std::string &value = args[++i];
+			bool valid;
+
+			if (option == "-d") {
+				config.directory = value;
+				valid = true;
+			}
+			else if (option == "-b") {
+				valid = Parse_Size(value, config.buffer_size);
+			}
+			else if (option == "-s") {
+				valid = Parse_Size(value, config.file_size);
+			}
+			else if (option == "-t") {
+				valid = Parse_Count(value, config.threads);
+			}
+			else if (option == "-n") {
+				valid = Parse_Count(value, config.metadata_files);
+			}
+			else {
+				valid = false;
+			}
+
+			if (!valid) {
+				return false;
+			}
+		}
+
+		return config.threads <= Max_Threads && config.metadata_files <= Max_Metadata_Files;
+	}
+}
+
+extern "C" size_t __stdcall diskbench(const kiv_hal::TRegisters &regs) {
+	std::vector<std::string> args;
+	kiv_common::Parse_Arguments(regs, "diskbench", args);
+
+	config = TBench_Config();
+	if (!Parse_Config(args)) {
+		const char *usage = "Usage: diskbench [-d directory] [-b buffer_size] [-s file_size] [-t threads] [-n metadata_files]\n"
+			"Sizes are in bytes and accept K and M suffixes.\n";
+		kiv_os_rtl::Stdout_Print(regs, usage, strlen(usage));
+		kiv_os_rtl::Exit(EXIT_FAILURE);
+		return 0;
+	}
+
+	char line[160];
+	int length = snprintf(line, sizeof(line), "diskbench: %zu thread(s), file %zu B, buffer %zu B, %zu metadata files per thread\n\n",
+		config.threads, config.file_size, config.buffer_size, config.metadata_files);
+	kiv_os_rtl::Stdout_Print(regs, line, length);
+
+	length = snprintf(line, sizeof(line), "%-14s %10s %12s %12s %12s %12s\n", "test", "ops", "MB/s", "ops/s", "avg us", "max us");
+	kiv_os_rtl::Stdout_Print(regs, line, length);
+
+	const NBench_Phase phases[] = {
+		NBench_Phase::Sequential_Write, NBench_Phase::Sequential_Read, NBench_Phase::Random_Write, NBench_Phase::Random_Read,
+		NBench_Phase::Create, NBench_Phase::Open, NBench_Phase::Delete
+	};
+
+	int exit_code = EXIT_SUCCESS;
+	for (const auto bench_phase : phases) {
+		double wall_us;
+		const bool success = Run_Phase(bench_phase, wall_us);
+		Print_Row(regs, bench_phase, wall_us);
+
+		if (!success) {
+			length = snprintf(line, sizeof(line), "%s failed.\n", Phase_Names[static_cast<int>(bench_phase)]);
+			kiv_os_rtl::Stdout_Print(regs, line, length);
+			exit_code = EXIT_FAILURE;
+			break;
+		}
+	}
+
+	for (size_t i = 0; i < config.threads; i++) {
+		kiv_os_rtl::Delete_File(Data_File_Name(i).c_str());
+	}
+
+	kiv_os_rtl::Exit(exit_code);
+
+	return 0;
+}